@@ -0,0 +1,469 @@
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/socket.h>
+#include <sys/mman.h>
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <time.h>
+#include <errno.h>
+#include <err.h>
+
+#include "loop.h"
+#include "utils.h"
+#include "proto.h"
+#include "transport.h"
+#include "capture.h"
+
+/*
+ * Replay a capture with the original timing: capreplay [options] capture
+ *
+ * Requests a poller sent go to their original addresses, so a capture of a
+ * master is fed to a fleet of sensors. Requests a sensor received go to the
+ * address given by -a, which also overrides the addresses of a poller
+ * capture. Every recorded stream is replayed on its own connection, reply
+ * latencies and sizes are compared with the recorded ones.
+ */
+#define REPLAY_STREAMS		(UINT16_MAX + 1)
+#define REPLAY_LINGER		1000	/* msec to wait for the last replies */
+
+typedef struct Rec Rec;
+typedef struct Stream Stream;
+typedef struct Lat Lat;
+
+struct Rec {
+	uint64_t	usec;
+	uint16_t	len;
+	uint16_t	fd;
+	uint16_t	addr;
+	uint8_t		type;
+	const uint8_t	*data;
+};
+
+struct Stream {
+	int		fd;		/* the replay connection or -1 */
+	int		connecting;	/* out is sent once connected */
+	int64_t		sent;		/* usec of the unanswered request */
+	uint8_t		*out;		/* bytes not sent yet */
+	size_t		out_len;
+	size_t		out_size;
+};
+
+struct Lat {
+	int64_t		*v;
+	size_t		n;
+	size_t		size;
+};
+
+static const Transport *tr;
+static int target = -1;
+static double speed = 1;
+
+static const uint8_t *map;
+static size_t map_size, pos;
+static uint64_t first_usec;
+static int64_t t0;
+
+static Stream *streams;
+static LoopTimer replay_timer, linger_timer;
+static Lat lat_rec, lat_replay;
+static long chunks, bytes, nstreams, reply_rec, reply_replay;
+static long err_connect, err_reset, err_eof, skipped;
+
+static int64_t clock_usec(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (int64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+static void lat_add(Lat *l, int64_t usec)
+{
+	if (l->n == l->size) {
+		l->size = l->size ? 2 * l->size : 1024;
+		l->v = realloc(l->v, l->size * sizeof(*l->v));
+		if (l->v == NULL) {
+			err(EXIT_FAILURE, "realloc()");
+		}
+	}
+	l->v[l->n++] = usec;
+}
+
+static int lat_cmp(const void *a, const void *b)
+{
+	int64_t x = *(const int64_t *)a, y = *(const int64_t *)b;
+
+	return x < y ? -1 : x > y;
+}
+
+static void lat_print(const char *name, Lat *l)
+{
+	if (!l->n) {
+		printf("%s latency usec: -\n", name);
+		return;
+	}
+
+	qsort(l->v, l->n, sizeof(*l->v), lat_cmp);
+	printf("%s latency usec: n %zu p50 %lld p90 %lld p99 %lld max %lld\n",
+		name, l->n, (long long)l->v[l->n / 2],
+		(long long)l->v[l->n * 9 / 10],
+		(long long)l->v[l->n * 99 / 100],
+		(long long)l->v[l->n - 1]);
+}
+
+/* 1 - a record is read at *off, 0 - the end, -1 - the capture is cut. */
+static int rec_read(size_t *off, Rec *r)
+{
+	const uint8_t *p = map + *off;
+
+	if (*off == map_size) {
+		return 0;
+	}
+	if (map_size - *off < CAPTURE_REC_SIZE) {
+		return -1;
+	}
+
+	r->usec = get_le32(p) | (uint64_t)get_le32(p + 4) << 32;
+	r->len  = get_le16(p + 8);
+	r->fd   = get_le16(p + 10);
+	r->addr = get_le16(p + 12);
+	r->type = p[14];
+	r->data = p + CAPTURE_REC_SIZE;
+
+	if (map_size - *off - CAPTURE_REC_SIZE < r->len) {
+		return -1;
+	}
+	*off += CAPTURE_REC_SIZE + r->len;
+	return 1;
+}
+
+/* Requests go from the capturing device to its peer. */
+static int rec_is_request(const Rec *r)
+{
+	return r->addr == CAPTURE_ADDR_NONE ? r->type == CAP_IN :
+					      r->type == CAP_OUT;
+}
+
+/* Recorded latencies are gaps between a request and the next reply. */
+static void capture_scan(void)
+{
+	int64_t *sent = calloc(REPLAY_STREAMS, sizeof(*sent));
+	size_t off = CAPTURE_HDR_SIZE;
+	Rec r;
+	int rc;
+
+	if (sent == NULL) {
+		err(EXIT_FAILURE, "calloc()");
+	}
+
+	while ((rc = rec_read(&off, &r)) > 0) {
+		if (r.type == CAP_CLOSE) {
+			sent[r.fd] = 0;
+		} else if (rec_is_request(&r)) {
+			if (!sent[r.fd]) {
+				sent[r.fd] = r.usec + 1;
+			}
+		} else {
+			reply_rec += r.len;
+			if (sent[r.fd]) {
+				lat_add(&lat_rec, r.usec + 1 - sent[r.fd]);
+				sent[r.fd] = 0;
+			}
+		}
+	}
+	if (rc < 0) {
+		warnx("the capture is cut, the tail is ignored");
+		map_size = off;
+	}
+
+	free(sent);
+}
+
+static void stream_close(Stream *s)
+{
+	if (s->fd != -1) {
+		loop_fd_close(s->fd);
+		s->fd = -1;
+	}
+	s->connecting = 0;
+	s->out_len = 0;
+	s->sent = 0;
+}
+
+static void stream_flush(Stream *s)
+{
+	if (s->connecting) {
+		return;
+	}
+	while (s->out_len) {
+		ssize_t n = send(s->fd, s->out, s->out_len, MSG_NOSIGNAL);
+		if (n < 0) {
+			if (errno == EAGAIN || errno == EINTR) {
+				loop_fd_change(s->fd, LOOP_RD | LOOP_WR);
+			} else {
+				err_reset++;
+				stream_close(s);
+			}
+			return;
+		}
+		memmove(s->out, s->out + n, s->out_len - n);
+		s->out_len -= n;
+	}
+	loop_fd_change(s->fd, LOOP_RD);
+}
+
+static void stream_event(int fd, LoopEvent event, void *opaque)
+{
+	Stream *s = opaque;
+	uint8_t buf[4096];
+	ssize_t n;
+
+	if (s->connecting) {
+		if (!tr->check_connection(fd)) {
+			err_connect++;
+			stream_close(s);
+			return;
+		}
+		s->connecting = 0;
+		/* Recorded latencies don't include the connect. */
+		if (s->sent) {
+			s->sent = clock_usec();
+		}
+	}
+	if (event & LOOP_WR) {
+		stream_flush(s);
+		if (s->fd == -1) {
+			return;
+		}
+	}
+	if (!(event & (LOOP_RD | LOOP_ERR))) {
+		return;
+	}
+
+	n = recv(fd, buf, sizeof(buf), 0);
+	if (n <= 0) {
+		if (n < 0 && (errno == EAGAIN || errno == EINTR)) {
+			return;
+		}
+		if (n == 0) {
+			err_eof++;
+		} else {
+			err_reset++;
+		}
+		stream_close(s);
+		return;
+	}
+
+	reply_replay += n;
+	if (s->sent) {
+		lat_add(&lat_replay, clock_usec() - s->sent);
+		s->sent = 0;
+	}
+}
+
+/* Requests are queued until the connection is established. */
+static int stream_open(Stream *s, int addr)
+{
+	s->fd = tr->connect(addr, 1);
+	if (s->fd < 0) {
+		err_connect++;
+		return -1;
+	}
+	nstreams++;
+	s->connecting = 1;
+	loop_fd_add(s->fd, LOOP_WR, stream_event, s);
+	return 0;
+}
+
+static void stream_send(Stream *s, const uint8_t *data, size_t n)
+{
+	if (s->out_len + n > s->out_size) {
+		s->out_size = s->out_len + n;
+		s->out = realloc(s->out, s->out_size);
+		if (s->out == NULL) {
+			err(EXIT_FAILURE, "realloc()");
+		}
+	}
+	memcpy(s->out + s->out_len, data, n);
+	s->out_len += n;
+
+	if (!s->sent) {
+		s->sent = clock_usec();
+	}
+	chunks++;
+	bytes += n;
+	stream_flush(s);
+}
+
+static void replay_rec(const Rec *r)
+{
+	Stream *s = &streams[r->fd];
+
+	if (r->type == CAP_CLOSE) {
+		stream_close(s);
+		return;
+	}
+	if (!rec_is_request(r)) {
+		return;
+	}
+
+	int addr = target != -1 ? target : r->addr;
+	if (addr == CAPTURE_ADDR_NONE) {
+		skipped++;
+		return;
+	}
+
+	if (s->fd == -1 && stream_open(s, addr) < 0) {
+		return;
+	}
+	stream_send(s, r->data, r->len);
+}
+
+static void linger_tick(LoopTimer *t, void *opaque)
+{
+	UNUSED(t);
+	UNUSED(opaque);
+	loop_quit();
+}
+
+/* Records due by the scaled capture time are replayed. */
+static void replay_tick(LoopTimer *t, void *opaque)
+{
+	int64_t elapsed = (clock_usec() - t0) * speed;
+	size_t off = pos;
+	Rec r;
+
+	UNUSED(opaque);
+
+	while (rec_read(&off, &r) > 0) {
+		int64_t due = r.usec - first_usec;
+		if (due > elapsed) {
+			loop_timer_set(t, (due - elapsed) / speed / 1000);
+			return;
+		}
+		replay_rec(&r);
+		pos = off;
+	}
+
+	loop_timer_set(&linger_timer, REPLAY_LINGER);
+}
+
+static void usage(void)
+{
+	fprintf(stderr, "usage: capreplay [-a addr] [-s speed] "
+			"[-t transport] capture\n"
+		"  -a  send all requests to addr, required for sensor "
+			"captures\n"
+		"  -s  replay speed factor (1)\n");
+	exit(EXIT_FAILURE);
+}
+
+int main(int argc, char *argv[])
+{
+	const char *trname = NULL, *s;
+	struct stat st;
+	size_t off;
+	Rec r;
+	int c, fd, i;
+
+	while ((c = getopt(argc, argv, "a:s:t:")) != -1) {
+		switch (c) {
+		case 'a':
+			target = atoi(optarg);
+			break;
+		case 's':
+			speed = atof(optarg);
+			break;
+		case 't':
+			trname = optarg;
+			break;
+		default:
+			usage();
+		}
+	}
+
+	if (optind + 1 != argc || speed <= 0 || target < -1 || target > 255) {
+		usage();
+	}
+
+	tr = transport_find(trname ? trname : getenv("TRANSPORT"));
+	if (tr == NULL) {
+		errx(EXIT_FAILURE, "unknown transport");
+	}
+	const char *base = getenv("TCP_BASE");
+	s = getenv("TCP_PORT");
+	if (transport_tcp_setup(base ? base : TRANSPORT_TCP_BASE,
+				s ? atoi(s) : TRANSPORT_TCP_PORT,
+				getenv("TRANSPORT_MAP")) < 0) {
+		errx(EXIT_FAILURE, "invalid TCP_BASE, TCP_PORT or TRANSPORT_MAP");
+	}
+
+	fd = open(argv[optind], O_RDONLY);
+	if (fd < 0 || fstat(fd, &st) < 0) {
+		err(EXIT_FAILURE, "%s", argv[optind]);
+	}
+	if ((size_t)st.st_size < CAPTURE_HDR_SIZE) {
+		errx(EXIT_FAILURE, "%s: not a capture", argv[optind]);
+	}
+	map = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+	close(fd);
+	if (map == MAP_FAILED) {
+		err(EXIT_FAILURE, "mmap()");
+	}
+	map_size = st.st_size;
+	if (get_le32(map) != CAPTURE_MAGIC ||
+	    get_le32(map + 4) != CAPTURE_VERSION) {
+		errx(EXIT_FAILURE, "%s: not a capture", argv[optind]);
+	}
+
+	capture_scan();
+
+	off = pos = CAPTURE_HDR_SIZE;
+	if (rec_read(&off, &r) <= 0) {
+		errx(EXIT_FAILURE, "%s: no records", argv[optind]);
+	}
+	first_usec = r.usec;
+
+	streams = calloc(REPLAY_STREAMS, sizeof(*streams));
+	if (streams == NULL) {
+		err(EXIT_FAILURE, "calloc()");
+	}
+	for (i = 0; i < REPLAY_STREAMS; i++) {
+		streams[i].fd = -1;
+	}
+
+	if (loop_init(LOOP_DRV_DEFAULT) < 0) {
+		errx(EXIT_FAILURE, "loop_init()");
+	}
+	loop_timer_init(&replay_timer, replay_tick, NULL);
+	loop_timer_init(&linger_timer, linger_tick, NULL);
+
+	t0 = clock_usec();
+	loop_timer_set(&replay_timer, 0);
+	loop_run();
+
+	printf("replayed %ld chunks, %ld bytes on %ld streams in %.3f s "
+		"(speed %g)\n", chunks, bytes, nstreams,
+		(clock_usec() - t0) / 1e6 - REPLAY_LINGER / 1e3, speed);
+	printf("reply bytes: recorded %ld replayed %ld\n",
+		reply_rec, reply_replay);
+	lat_print("recorded", &lat_rec);
+	lat_print("replayed", &lat_replay);
+	printf("errors: connect %ld reset %ld eof %ld skipped %ld\n",
+		err_connect, err_reset, err_eof, skipped);
+
+	for (i = 0; i < REPLAY_STREAMS; i++) {
+		stream_close(&streams[i]);
+		free(streams[i].out);
+	}
+	loop_fini();
+	free(streams);
+	free(lat_rec.v);
+	free(lat_replay.v);
+	munmap((void *)map, map_size);
+	return EXIT_SUCCESS;
+}
@@ -0,0 +1,127 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <time.h>
+#include <errno.h>
+
+#include "proto.h"
+#include "capture.h"
+
+struct Capture {
+	int		fd;
+	int		error;		/* a write failed, records are dropped */
+	int64_t		start;		/* monotonic usec */
+	size_t		len;
+	uint8_t		buf[CAPTURE_BUF_SIZE];
+};
+
+static int64_t clock_usec(clockid_t id)
+{
+	struct timespec ts;
+
+	clock_gettime(id, &ts);
+	return (int64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+static int capture_write(Capture *c, const uint8_t *p, size_t n)
+{
+	while (n) {
+		ssize_t rc = write(c->fd, p, n);
+		if (rc < 0) {
+			if (errno == EINTR) {
+				continue;
+			}
+			c->error = 1;
+			return -1;
+		}
+		p += rc;
+		n -= rc;
+	}
+	return 0;
+}
+
+Capture *capture_open(const char *prefix, int host)
+{
+	char path[256];
+	Capture *c;
+	int64_t wall;
+
+	c = calloc(1, sizeof(*c));
+	if (c == NULL) {
+		return NULL;
+	}
+
+	snprintf(path, sizeof(path), "%s.%d", prefix, host);
+	c->fd = open(path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+	if (c->fd < 0) {
+		free(c);
+		return NULL;
+	}
+
+	c->start = clock_usec(CLOCK_MONOTONIC);
+	wall = clock_usec(CLOCK_REALTIME);
+	put_le32(c->buf, CAPTURE_MAGIC);
+	put_le32(c->buf + 4, CAPTURE_VERSION);
+	put_le32(c->buf + 8, wall & 0xffffffff);
+	put_le32(c->buf + 12, (uint64_t)wall >> 32);
+	c->len = CAPTURE_HDR_SIZE;
+
+	return c;
+}
+
+void capture_put(Capture *c, int type, int fd, int addr,
+		const void *data, size_t n)
+{
+	uint64_t usec = clock_usec(CLOCK_MONOTONIC) - c->start;
+	uint8_t *r;
+
+	if (c->error || n > UINT16_MAX) {
+		return;
+	}
+
+	if (c->len + CAPTURE_REC_SIZE + n > sizeof(c->buf) &&
+	    capture_flush(c) < 0) {
+		return;
+	}
+
+	r = c->buf + c->len;
+	put_le32(r, usec & 0xffffffff);
+	put_le32(r + 4, usec >> 32);
+	put_le16(r + 8, n);
+	put_le16(r + 10, fd);
+	put_le16(r + 12, addr < 0 ? CAPTURE_ADDR_NONE : addr);
+	r[14] = type;
+	r[15] = 0;
+	c->len += CAPTURE_REC_SIZE;
+
+	/* Chunks never exceed the buffer, peer buffers are small. */
+	if (c->len + n > sizeof(c->buf)) {
+		capture_flush(c);
+		capture_write(c, data, n);
+		return;
+	}
+	if (n) {
+		memcpy(c->buf + c->len, data, n);
+		c->len += n;
+	}
+}
+
+int capture_flush(Capture *c)
+{
+	int rc = 0;
+
+	if (c->len && !c->error) {
+		rc = capture_write(c, c->buf, c->len);
+	}
+	c->len = 0;
+	return rc;
+}
+
+void capture_close(Capture *c)
+{
+	capture_flush(c);
+	close(c->fd);
+	free(c);
+}
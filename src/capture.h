@@ -0,0 +1,45 @@
+#ifndef CAPTURE_H
+#define CAPTURE_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+/*
+ * A capture file keeps the bytes a device exchanged with its peers:
+ *
+ *   header: u32 magic | u32 version | i64 wall clock usec of the start
+ *   record: u64 usec | u16 len | u16 fd | u16 addr | u8 type | u8 pad | data
+ *
+ * All fields are little-endian, usec is monotonic since the start, addr is
+ * the polled address or CAPTURE_ADDR_NONE for accepted peers. A record is a
+ * chunk as it was received or sent, CAP_CLOSE marks the end of the stream
+ * on the fd. Records are collected in memory and written in batches.
+ */
+#define CAPTURE_DEFAULT		"telco.cap"
+#define CAPTURE_MAGIC		0x57434c54	/* "TLCW" */
+#define CAPTURE_VERSION		1
+#define CAPTURE_HDR_SIZE	16
+#define CAPTURE_REC_SIZE	16
+#define CAPTURE_ADDR_NONE	0xffff
+#define CAPTURE_BUF_SIZE	(64 * 1024)
+
+enum {
+	CAP_IN,
+	CAP_OUT,
+	CAP_CLOSE,
+};
+
+typedef struct Capture Capture;
+
+/* Create prefix.host, an existing capture is truncated. */
+Capture *capture_open(const char *prefix, int host);
+
+/* Append a record, the buffer is written out when it is full. */
+void capture_put(Capture *c, int type, int fd, int addr,
+		const void *data, size_t n);
+
+int capture_flush(Capture *c);
+
+void capture_close(Capture *c);
+
+#endif
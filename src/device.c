@@ -1,6 +1,7 @@
 #include <sys/types.h>
 #include <sys/socket.h>
 
+#include <stddef.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
@@ -12,23 +13,16 @@
 
 #include "utils.h"
 #include "loop.h"
-#include "unix.h"
-#include "list.h"
+#include "transport.h"
+#include "discovery.h"
+#include "source.h"
+#include "capture.h"
+#include "probes.h"
+#include "proto.h"
 #include "device.h"
 
-//#define FUZZ_IO		1
-
 #define PEER_BUF_SIZE	128
 
-#define MSG_HELLO	1
-#define MSG_GET		2
-#define MSG_RES		3
-
-#define	PARAM_TEXT	1	/* nul-terminated */
-#define PARAM_TEMP	2	/* 2 bytes */
-#define PARAM_BRGHT	3	/* 2 bytes */
-#define PARAM_MAX	4
-
 #define DEF_FMT		" [ %6s %3u ]"
 
 #define SOFT_ERROR		(errno == EINTR || errno == EAGAIN || \
@@ -49,14 +43,32 @@ struct PeerVtable {
 };
 
 struct Peer {
-	struct list	list;
 	Device		*dev;	/* point to its device */
 	int		fd;
 	unsigned char	*buf;
 	size_t		size;	/* buf size */
 	size_t		off;	/* offset in buf for rd/wr */
 	size_t		left;	/* left bytes for wr */
+	size_t		spill;	/* bytes of pipelined frames after buf */
+	int64_t		start;	/* connection start time */
+	int		addr;	/* polled address or -1 */
+	int		reused;	/* connection is taken from the idle ones */
+	int		proto;	/* protocol version of the exchange */
+	uint32_t	id;	/* v2 request id */
+	uint32_t	epoch;	/* v2 message epoch sent in GET */
+	TlvDecoder	dec;	/* v1 message decoder */
+	LoopTimer	deadline; /* no progress timeout of a polled peer */
+	int		timeout; /* deadline in msec */
+	unsigned	cycle;	/* polling cycle the peer is dispatched in */
+	int		pooled;	/* the slot of dev->peers of its addr */
+	size_t		qoff;	/* offset of unsent queued frames */
+	size_t		qlen;	/* end of queued frames */
+	int		pushes;	/* pushes received on a subscription */
+	LoopTimer	keepalive; /* keepalive GETs of a subscription */
 	const PeerVtable *v;
+	/* The second half keeps pipelined v2 frames while the first one is
+	 * reused for the reply, a subscription queues its frames there. */
+	unsigned char	data[2 * PEER_BUF_SIZE];
 };
 
 struct Range {
@@ -68,34 +80,130 @@ typedef struct Range Range;
 
 static void device_next_step(Device *dev);
 static void device_master_resolve(Device *dev);
+static void device_poll_cycle_done(Device *dev);
+static void device_dispatch(Device *dev);
+static void device_status_publish(Device *dev);
+static void device_snapshot_save(Device *dev);
+static void peer_deadline_tick(LoopTimer *t, void *opaque);
+static void peer_keepalive_tick(LoopTimer *t, void *opaque);
+
+static void device_step_task(LoopTask *t, void *opaque)
+{
+	UNUSED(t);
+	device_next_step(opaque);
+}
 
-static Peer *peer_alloc(int fd, Device *dev)
+/* Transitions made in I/O callbacks are re-planned once after dispatch of
+ * the loop iteration instead of from inside the callbacks. */
+static void device_step_defer(Device *dev)
 {
-	Peer *p = calloc(1, sizeof(*p) + PEER_BUF_SIZE);
-	if (p == NULL) {
-		return NULL;
+	if (loop_task_pending(&dev->step_task)) {
+		dev->stats.steps_coalesced++;
+		return;
 	}
+	loop_defer(&dev->step_task);
+}
 
+static void peer_init(Peer *p, int fd, Device *dev)
+{
+	memset(p, 0, offsetof(Peer, data));
 	p->fd = fd;
-	p->buf = (unsigned char *)p + sizeof(*p);
+	p->buf = p->data;
 	p->size = PEER_BUF_SIZE;
 	p->dev = dev;
+	p->addr = -1;
+	p->proto = PROTO_V1;
+	loop_timer_init(&p->deadline, peer_deadline_tick, p);
+	loop_timer_init(&p->keepalive, peer_keepalive_tick, p);
+}
+
+/* Accepted connections come from the heap. */
+static Peer *peer_alloc(int fd, Device *dev)
+{
+	Peer *p = malloc(sizeof(*p));
+	if (p == NULL) {
+		return NULL;
+	}
+
+	peer_init(p, fd, dev);
+	return p;
+}
+
+/* A polled peer takes the preallocated slot of its address, a sensor is
+ * polled by a single peer at a time. */
+static Peer *peer_pool_get(Device *dev, int fd, int addr)
+{
+	Peer *p = &dev->peers[addr];
 
+	peer_init(p, fd, dev);
+	p->addr = addr;
+	p->pooled = 1;
 	return p;
 }
 
 static void peer_dealloc(Peer *p)
 {
-	free(p);
+	loop_timer_cancel(&p->deadline);
+	loop_timer_cancel(&p->keepalive);
+	if (!p->pooled) {
+		free(p);
+	}
+}
+
+/* Chunks are recorded as they are received and sent. */
+static void
+device_capture(Device *dev, int type, int fd, int addr, const void *d, size_t n)
+{
+	if (dev->cap != NULL) {
+		capture_put(dev->cap, type, fd, addr, d, n);
+	}
+}
+
+static void device_capture_tick(LoopTimer *t, void *opaque)
+{
+	Device *dev = opaque;
+
+	if (capture_flush(dev->cap) < 0) {
+		warn("capture_flush()");
+	}
+	loop_timer_set(t, DEVICE_CAPTURE_FLUSH);
 }
 
 static void peer_close(Peer *p)
 {
-	loop_fd_del(p->fd);
-	close(p->fd);
+	device_capture(p->dev, CAP_CLOSE, p->fd, p->addr, NULL, 0);
+	loop_fd_close(p->fd);
+	peer_dealloc(p);
+}
+
+/* Keep the connection to reuse it in the next cycle. */
+static void peer_park(Peer *p)
+{
+	Device *dev = p->dev;
+
+	if (dev->idle[p->addr] == -1) {
+		loop_fd_del(p->fd);
+		dev->idle[p->addr] = p->fd;
+	} else {
+		device_capture(dev, CAP_CLOSE, p->fd, p->addr, NULL, 0);
+		loop_fd_close(p->fd);
+	}
 	peer_dealloc(p);
 }
 
+static void device_idle_close(Device *dev)
+{
+	int i;
+
+	for (i = 0; i <= DEVICE_HOST_ADDR_MAX; i++) {
+		if (dev->idle[i] != -1) {
+			device_capture(dev, CAP_CLOSE, dev->idle[i], i, NULL, 0);
+			loop_fd_close(dev->idle[i]);
+			dev->idle[i] = -1;
+		}
+	}
+}
+
 static void peer_vtable_set(Peer *p, const PeerVtable *v)
 {
 	p->v = v;
@@ -122,32 +230,157 @@ static int device_iscontroller(const Device *dev)
 	return dev->state == DEV_STATE_CONTROLLER ? 1 : 0;
 }
 
+/* Every state transition goes through here to be traced. */
+static void device_state_set(Device *dev, int state)
+{
+	PROBE3(state_change, dev->host, dev->state, state);
+	dev->state = state;
+}
+
+/* Format what the device shows now: averages of a master, the message
+ * shown by a slave or the state only. */
+static void device_display_render(const Device *dev, char *buf, size_t n)
+{
+	int m = snprintf(buf, n, DEF_FMT, device_state2name(dev), dev->host);
+
+	if (m < 0 || (size_t)m >= n) {
+		return;
+	}
+
+	switch (dev->state) {
+	case DEV_STATE_CONTROLLER:
+	case DEV_STATE_MASTER:
+		if (!dev->param_avg_set) {
+			break;
+		}
+		snprintf(buf + m, n - m, " brigtness (avg): %u, temp (avg): "
+			"%u'C, poll: %d ms [%d, %d], window: %d, cost: %d ms "
+			"(%s)", dev->param_avg.brgth, dev->param_avg.temp,
+			dev->stats.interval, dev->stats.interval_min,
+			dev->stats.interval_max, dev->stats.window,
+			dev->stats.cycle_cost, dev->tr->name);
+		break;
+	case DEV_STATE_SLAVE:
+		if (!dev->shown_msg[0]) {
+			break;
+		}
+		snprintf(buf + m, n - m, " brigtness: %u, message: \"%s\"",
+				dev->shown_brgth, dev->shown_msg);
+		break;
+	default:
+		break;
+	}
+}
+
+static void device_display_flush(Device *dev)
+{
+	char buf[sizeof(dev->display)];
+
+	loop_timer_cancel(&dev->display_timer);
+	dev->display_dirty = 0;
+
+	device_display_render(dev, buf, sizeof(buf));
+	if (!strcmp(buf, dev->display)) {
+		dev->stats.display_skipped++;
+		return;
+	}
+
+	memcpy(dev->display, buf, sizeof(buf));
+	dev->ops->display(dev, "%s", buf);
+}
+
+static void device_display_tick(LoopTimer *t, void *opaque)
+{
+	UNUSED(t);
+	device_display_flush(opaque);
+}
+
+/* Mark the display dirty, it is rendered once per display tick. State
+ * transitions are rendered at once. */
+static void device_display(Device *dev, int now)
+{
+	if (now || !dev->display_tick) {
+		device_display_flush(dev);
+		return;
+	}
+
+	if (!dev->display_dirty) {
+		dev->display_dirty = 1;
+		loop_timer_set(&dev->display_timer, dev->display_tick);
+	}
+}
+
+/* Protocol version to talk with the address, 0 if it is unknown. */
+static int device_peer_proto(const Device *dev, int addr)
+{
+	return dev->proto_max == PROTO_V1 ? PROTO_V1 : dev->proto[addr];
+}
+
+/* The polled peer of the address or NULL. */
+static Peer *device_peer_find(const Device *dev, int addr)
+{
+	return dev->active[addr / 64] >> (addr % 64) & 1 ?
+		&dev->peers[addr] : NULL;
+}
+
+static int device_peers_active(const Device *dev)
+{
+	int w;
+
+	for (w = 0; w < DEVICE_READINGS_WORDS; w++) {
+		if (dev->active[w]) {
+			return 1;
+		}
+	}
+	return 0;
+}
+
 static int device_is_polling_inprogress(const Device *dev)
 {
-	return dev->head ? 1 : 0;
+	return device_peers_active(dev) ||
+		dev->fanout.next <= dev->fanout.to ? 1 : 0;
 }
 
 static void device_drop_peers(Device *dev)
 {
-	list_foreach((struct list *)dev->head, (void *)peer_close, NULL);
-	dev->head = NULL;
+	int w;
+
+	for (w = 0; w < DEVICE_READINGS_WORDS; w++) {
+		uint64_t bits = dev->active[w];
+
+		while (bits) {
+			int i = w * 64 + __builtin_ctzll(bits);
+
+			bits &= bits - 1;
+			peer_close(&dev->peers[i]);
+		}
+		dev->active[w] = 0;
+	}
+	/* Forget not dispatched addresses too. */
+	dev->fanout.next = dev->fanout.to + 1;
+	dev->fanout.inflight = 0;
+	loop_timer_cancel(&dev->fanout.timer);
 }
 
-static void device_drop_peer(Device *dev, Peer *p)
+static void device_unlink_peer(Device *dev, const Peer *p)
 {
-	list_remove((struct list **)&dev->head, (struct list *)p);
-	peer_close(p);
+	assert(p == &dev->peers[p->addr]);
+	dev->active[p->addr / 64] &= ~(1ULL << (p->addr % 64));
+	dev->fanout.inflight--;
 }
 
-static uint16_t get_u16(uint8_t *p)
+static void device_detach_peer(Device *dev, Peer *p, int park)
 {
-	return (p[0] << 8) | p[1];
+	PROBE3(peer_detach, p->fd, p->addr, park);
+	device_unlink_peer(dev, p);
+	park ? peer_park(p) : peer_close(p);
+	/* The window has a free place, dispatch the next address. */
+	device_dispatch(dev);
 }
 
-static void put_u16(uint8_t *p, uint16_t n)
+static void device_drop_peer(Device *dev, Peer *p)
 {
-	p[0] = (n >> 8) & 0xff;
-	p[1] = n        & 0xff;
+	device_detach_peer(dev, p, 0);
 }
 
 static void peer_hello_send(Peer *p)
@@ -157,9 +390,23 @@ static void peer_hello_send(Peer *p)
 	p->off  = 0;
 }
 
+static void peer_hello2_send(Peer *p, uint8_t ver)
+{
+	uint8_t *q = proto_frame_begin(p->buf, MSG2_HELLO, p->id);
+
+	*q = ver;
+	p->left = proto_frame_end(p->buf, 1);
+	p->off  = 0;
+}
+
 static void peer_hello_req_send(Peer *p)
 {
-	peer_hello_send(p);
+	if (p->proto == PROTO_V2) {
+		p->id = ++p->dev->req_id;
+		peer_hello2_send(p, p->dev->proto_max);
+	} else {
+		peer_hello_send(p);
+	}
 }
 
 static void peer_hello_resp_send(Peer *p)
@@ -177,151 +424,134 @@ static int peer_hello_req_recv(Peer *p)
 	return 0;
 }
 
+/* Readings come from the value source of the device. */
+static void device_reading_gen(Device *dev, uint16_t *temp, uint16_t *brgth)
+{
+	source_next(dev->src, temp, brgth);
+}
+
+/* Samples are taken between polls and summarized in v2 RES. */
+static void device_sample_tick(LoopTimer *t, void *opaque)
+{
+	Device *dev = opaque;
+	uint16_t temp, brgth;
+
+	device_reading_gen(dev, &temp, &brgth);
+	sampler_put(&dev->sampler, temp, brgth);
+	loop_timer_set(t, dev->sample);
+}
+
 static void peer_get_resp_send(Peer *p)
 {
-	unsigned char *q = p->buf;
-	/* Generate random values in response. */
-	struct {
-		uint8_t	 n;
-		uint16_t v;
-	} val[] = {
-		{ MSG_RES,	9 },
-#define GEN_XXX(s, e)	((s) + rand() % ((e) - (s)) + 1)
-		{ PARAM_TEMP,	GEN_XXX(10, 25) },
-		{ PARAM_BRGHT,	GEN_XXX(50, 70) }
-	};
-#undef GEN_XXX
-	int i;
+	TlvValue vals[TLV_FIELDS_MAX] = { { 0 } };
 
-	for (i = 0; i < (int)ARRSZ(val); i++) {
-		*q++ = val[i].n;
-		put_u16(q, val[i].v);
-		q += 2;
-	}
+	vals[RES_TEMP].set = vals[RES_BRGHT].set = 1;
+	device_reading_gen(p->dev, &vals[RES_TEMP].u16, &vals[RES_BRGHT].u16);
 
 	p->off  = 0;
-	p->left = 9;
+	p->left = tlv_encode(&proto_res_schema, p->buf, p->size, vals);
 }
 
 static void
 peer_get_req_send(Peer *p, const char *msg, size_t n, uint16_t brght)
 {
-	unsigned char *q = p->buf;
+	TlvValue vals[TLV_FIELDS_MAX] = { { 0 } };
+
+	/* n includes 0 */
+	vals[GET_TEXT].set = 1;
+	vals[GET_TEXT].str = msg;
+	vals[GET_TEXT].len = n - 1;
+	vals[GET_BRGHT].set = 1;
+	vals[GET_BRGHT].u16 = brght;
 
-	/* n must includes 0 */
-	n = n > p->size - 7 ? p->size - 7 : n;
-	uint16_t len = 1 + 2 + 1 + n + 1 + 2;
+	p->left = tlv_encode(&proto_get_schema, p->buf, p->size, vals);
+	p->off  = 0;
+}
+
+/* Build a v2 GET to the address, returns the frame length. */
+static size_t device_get2_build(Device *dev, int addr, uint8_t *buf,
+				uint32_t id, uint32_t *epoch)
+{
+	uint8_t *q = proto_frame_begin(buf, MSG2_GET, id);
+	/* net_msg_len includes 0 which is not sent in v2. */
+	size_t n = dev->net_msg_len ? dev->net_msg_len - 1 : 0;
+	uint8_t flags = n ? GET2_F_BRGHT | GET2_F_TEXT : 0;
+
+	/* The peer already shows the text of the current epoch. */
+	if (n && dev->msg_acked[addr] == dev->msg_epoch) {
+		flags = GET2_F_BRGHT | GET2_F_UNCHANGED;
+		n = 0;
+		dev->stats.msg_suppressed++;
+	}
 
-	*q++ = MSG_GET;
-	put_u16(q, len);
-	q += 2;
+	/* Sensors without a sampler ignore the flag. */
+	q[0] = flags | GET2_F_SUMMARY;
+	q[1] = dev->batch;
+	put_le16(q + 2, flags ? dev->param_avg.brgth : 0);
+	put_le32(q + 4, *epoch = flags ? dev->msg_epoch : 0);
+	q[8] = n;
+	memcpy(q + GET2_FIXED_SIZE, dev->net_msg, n);
 
-	*q++ = PARAM_TEXT;
-	memcpy(q, msg, n);
-	q[n] = 0;	/* make sure it is nullterminated */
-	q += n;
+	return proto_frame_end(buf, GET2_FIXED_SIZE + n);
+}
 
-	*q++ = PARAM_BRGHT;
-	put_u16(q, brght);
-	q += 2;
+static void peer_get2_req_send(Peer *p)
+{
+	Device *dev = p->dev;
 
-	p->left = len;
+	p->id = ++dev->req_id;
+	p->left = device_get2_build(dev, p->addr, p->buf, p->id, &p->epoch);
 	p->off  = 0;
 }
 
 static void peer_get_req_empty_send(Peer *p)
 {
-	unsigned char *q = p->buf;
-	const uint16_t len = 3;
+	TlvValue vals[TLV_FIELDS_MAX] = { { 0 } };
 
-	*q++ = MSG_GET;
-	put_u16(q, len);
-
-	p->left = len;
+	p->left = tlv_encode(&proto_get_schema, p->buf, p->size, vals);
 	p->off  = 0;
 }
 
+/* Continue decoding of a v1 message from the last parsed byte. */
+static int peer_tlv_decode(Peer *p, const TlvSchema *schema)
+{
+	if (p->dec.schema != schema) {
+		tlv_decoder_init(&p->dec, schema);
+	}
+
+	return tlv_decode(&p->dec, p->buf, p->off, p->size);
+}
+
+static void device_msg_show(Device *dev, uint16_t brgth, const char *text)
+{
+	size_t n = strlen(text);
+
+	/* Texts longer than a v1 message are cut. */
+	n = n < sizeof(dev->shown_msg) ? n : sizeof(dev->shown_msg) - 1;
+	memcpy(dev->shown_msg, text, n);
+	dev->shown_msg[n] = 0;
+	dev->shown_brgth = brgth;
+	device_display(dev, 0);
+}
+
 static int peer_get_req_param_recv(Peer *p)
 {
 	Device *dev = p->dev;
-	unsigned char *q = p->buf;
-	size_t n = p->off;
-
-	struct {
-		union {
-			uint16_t val;
-			char	 *str;
-		};
-		int	 upd;
-	} params[PARAM_MAX];
-
-	/* Partial read. */
-	if (n < 3) {
-		return 1;
-	}
-
-	q += 1;
-	uint16_t len = get_u16(q);
-	/* read more bytes than packet reports or len is more than buf max size */
-	if (len < 3 || n > len || len > p->size) {
-		return -1;
-	}
-	q += 2;
+	const TlvValue *params = p->dec.vals;
 
-	/* Partial read. */
-	if (len > n) {
-		return 1;
+	int rc = peer_tlv_decode(p, &proto_get_schema);
+	if (rc != 0) {
+		return rc;
 	}
 
-	assert(n == len);
-	unsigned char *e = q + len - 3;
 	/* empty MSG_GET */
-	if (q == e) {
+	if (!params[GET_TEXT].set) {
 		return 0;
 	}
 
-	memset(&params, 0, sizeof(params));
-	while (q < e) {
-		unsigned char type = *q++;
-		unsigned char *s;
-		switch (type) {
-		case PARAM_TEXT:
-			if (params[type].upd) {
-				return -1;
-			}
-			s = memchr(q, 0, e - q);
-			if (s == NULL) {
-				return -1;
-			}
-			params[type].upd = 1;
-			params[type].str = (char *)q;
-			q = s + 1;
-			break;
-		case PARAM_BRGHT:
-			if (params[type].upd) {
-				return -1;
-			}
-			if (q + 2 > e) {
-				return -1;
-			}
-			params[type].upd = 1;
-			params[type].val = get_u16(q);
-			q += 2;
-			break;
-		default:
-			return -1;
-		}
-	}
-
-	if (!params[PARAM_TEXT].upd || !params[PARAM_BRGHT].upd) {
-		return -1;
-	}
-
 	warnx("RECV GET: brigtness: %u, message: \"%s\"",
-			params[PARAM_BRGHT].val, params[PARAM_TEXT].str);
-	dev->ops->display(dev, DEF_FMT " brigtness: %u, message: \"%s\"",
-			device_state2name(dev) , dev->host,
-			params[PARAM_BRGHT].val, params[PARAM_TEXT].str);
+			params[GET_BRGHT].u16, params[GET_TEXT].str);
+	device_msg_show(dev, params[GET_BRGHT].u16, params[GET_TEXT].str);
 	return 0;
 }
 
@@ -340,91 +570,471 @@ static int peer_get_req_recv(Peer *p)
 	return 0;
 }
 
-static int peer_msg_req_recv(Peer *p)
+static int peer_hello2_req_recv(Peer *p, const ProtoHdr *h)
 {
 	Device *dev = p->dev;
-	unsigned char type = *p->buf;
-	int rc = -1;
+	uint8_t *q = p->buf + PROTO_HDR_SIZE;
 
-	switch (type) {
-	case MSG_HELLO:
-		rc = peer_hello_req_recv(p);
-		break;
-	case MSG_GET:
-		rc = peer_get_req_recv(p);
-		break;
-	default:
-		rc = -1;
-		break;
+	if (h->len != PROTO_FRAME_MIN + 1 || *q < PROTO_V2) {
+		return -1;
 	}
 
-	if (rc < 0) {
-		return rc;
+	/* Reply with the highest version both sides support. */
+	p->id = h->id;
+	peer_hello2_send(p, *q < dev->proto_max ? *q : dev->proto_max);
+	return 0;
+}
+
+/* Show the text of a v2 GET payload, returns RES flags or -1. */
+static int device_get2_apply(Device *dev, const uint8_t *q, size_t n)
+{
+	char text[PEER_BUF_SIZE];
+
+	if (n < GET2_FIXED_SIZE || n != GET2_FIXED_SIZE + (size_t)q[8]) {
+		return -1;
 	}
 
-	/* HELLO is echoed and doesn't influence on the state. */
-	if (type == MSG_HELLO) {
-		return 0;
+	uint8_t flags = q[0];
+	uint16_t brgth = get_le16(q + 2);
+	uint32_t epoch = get_le32(q + 4);
+
+	if (flags & GET2_F_TEXT) {
+		memcpy(text, q + GET2_FIXED_SIZE, q[8]);
+		text[q[8]] = 0;
+		dev->msg_epoch_rx = epoch;
+		warnx("RECV GET: brigtness: %u, message: \"%s\"", brgth, text);
+		device_msg_show(dev, brgth, text);
+	} else if ((flags & GET2_F_UNCHANGED) && epoch != dev->msg_epoch_rx) {
+		/* The text is not shown, ask to send it again. */
+		return RES2_F_STALE;
 	}
 
-	if (dev->state != DEV_STATE_SLAVE) {
-		/* In unknown and master states the device can poll sensors,
-		 * since someone polls us the device is a slave stop polling */
-		if (device_is_polling_inprogress(dev)) {
-			device_drop_peers(dev);
-		}
+	return 0;
+}
 
-		warnx("%s -> SLAVE", device_state2name(dev));
-		dev->state = DEV_STATE_SLAVE;
-		dev->ops->display(dev, DEF_FMT,
-					device_state2name(dev), dev->host);
+static int peer_get2_req_recv(Peer *p, const ProtoHdr *h)
+{
+	Device *dev = p->dev;
+	uint8_t *q = p->buf + PROTO_HDR_SIZE;
+	int i;
+
+	warnx("RECV GET v2");
+
+	int res_flags = device_get2_apply(dev, q, h->len - PROTO_FRAME_MIN);
+	if (res_flags < 0) {
+		return -1;
 	}
 
-	assert(dev->state == DEV_STATE_SLAVE);
-	device_next_step(dev);
+	int count = q[1] ? q[1] : 1;
+	SamplerWindow w;
+
+	/* A summary of the samples instead of instant readings. */
+	if ((q[0] & GET2_F_SUMMARY) && dev->sample &&
+	    sampler_window(&dev->sampler, &w)) {
+		q = proto_frame_begin(p->buf, MSG2_RES, h->id);
+		q[0] = 1;
+		q[1] = res_flags | RES2_F_SUMMARY;
+		q += RES2_FIXED_SIZE;
+		put_le16(q, w.count);
+		put_le16(q + 2, w.temp_mean);
+		put_le16(q + 4, w.temp_min);
+		put_le16(q + 6, w.temp_max);
+		put_le16(q + 8, w.temp_last);
+		put_le16(q + 10, w.brgth_mean);
+		put_le16(q + 12, w.brgth_min);
+		put_le16(q + 14, w.brgth_max);
+		put_le16(q + 16, w.brgth_last);
+		p->left = proto_frame_end(p->buf,
+				RES2_FIXED_SIZE + RES2_SUMMARY_SIZE);
+		p->off  = 0;
+		return 0;
+	}
+
+	/* Batch several readings in a single reply. */
+	count = count > PROTO_BATCH_MAX ? PROTO_BATCH_MAX : count;
+	q = proto_frame_begin(p->buf, MSG2_RES, h->id);
+	q[0] = count;
+	q[1] = res_flags;
+	for (i = 0; i < count; i++) {
+		uint16_t temp, brgth;
+		uint8_t *r = q + RES2_FIXED_SIZE + i * RES2_READING_SIZE;
+		device_reading_gen(dev, &temp, &brgth);
+		put_le16(r, temp);
+		put_le16(r + 2, brgth);
+	}
 
+	p->left = proto_frame_end(p->buf,
+			RES2_FIXED_SIZE + count * RES2_READING_SIZE);
+	p->off  = 0;
 	return 0;
 }
 
-static void peer_rdwr_event(int fd, LoopEvent event, void *opaque)
+/* v2 connections stay open, the next pipelined frame is processed after
+ * the reply is written. */
+static int peer_msg2_after_write(Peer *p)
 {
-	Peer *p = opaque;
-	int eof = 0;
+	memcpy(p->buf, p->buf + p->size, p->spill);
+	p->off = p->spill;
+	p->spill = 0;
+	loop_fd_change(p->fd, LOOP_RD);
+	return p->off ? p->v->on_in(p) : 0;
+}
 
-	if (event & LOOP_ERR) {
-		goto drop;
+/* Subscription frames are queued and written as the peer takes them while
+ * the connection keeps reading, a peer which doesn't take a buffer of them
+ * is too slow to stay subscribed. */
+static int peer_frame_push(Peer *p, const uint8_t *buf, size_t n)
+{
+	unsigned char *q = p->buf + p->size;
+
+	if (p->qlen + n > p->size) {
+		memmove(q, q + p->qoff, p->qlen - p->qoff);
+		p->qlen -= p->qoff;
+		p->qoff  = 0;
+	}
+	if (p->qlen + n > p->size) {
+		return -1;
 	}
 
+	memcpy(q + p->qlen, buf, n);
+	p->qlen += n;
+	loop_fd_change(p->fd, LOOP_RD | LOOP_WR);
+	return 0;
+}
 
-	if (event & LOOP_RD) {
-		int m = p->size - p->off;
-#ifdef FUZZ_IO
-		m = 1 + rand() % m;
-#endif
-		ssize_t n = recv(fd, p->buf + p->off, m, 0);
-		if (n <= 0) {
-			if (n == 0 || (n < 0 && !SOFT_ERROR)) {
-				eof = n == 0 ? 1 : 0;
-				goto drop;
-			}
-		} else {
-			p->off += n;
-			if (p->v->on_in(p) < 0) {
-				goto drop;
-			}
+static void device_upstream_close(Device *dev)
+{
+	DeviceUpstream *up = &dev->up;
+
+	loop_timer_cancel(&up->timer);
+	peer_close(up->p);
+	up->p = NULL;
+}
+
+static int device_upstream_push(Device *dev)
+{
+	DeviceUpstream *up = &dev->up;
+	uint8_t buf[PROTO_FRAME_MIN + PUSH2_SIZE];
+	uint8_t *q = proto_frame_begin(buf, MSG2_PUSH, up->id);
+
+	put_le16(q, up->temp);
+	put_le16(q + 2, up->brgth);
+	put_le32(q + 4, dev->msg_epoch_rx);
+	up->pushed = clock_msec();
+	return peer_frame_push(up->p, buf, proto_frame_end(buf, PUSH2_SIZE));
+}
+
+/* Sample the source, push the reading when it leaves the deadband or when
+ * the heartbeat expires. */
+static void device_upstream_tick(LoopTimer *t, void *opaque)
+{
+	Device *dev = opaque;
+	DeviceUpstream *up = &dev->up;
+	uint16_t temp, brgth;
+
+	device_reading_gen(dev, &temp, &brgth);
+	if (abs(temp - up->temp) > up->deadband ||
+	    abs(brgth - up->brgth) > up->deadband ||
+	    clock_msec() - up->pushed >= up->heartbeat) {
+		up->temp = temp;
+		up->brgth = brgth;
+		if (device_upstream_push(dev) < 0) {
+			warnx("UNSUBSCRIBED");
+			device_upstream_close(dev);
+			return;
 		}
-	} else if (event & LOOP_WR) {
-		int m = p->left;
-#ifdef FUZZ_IO
-		m = 1 + rand() % m;
-#endif
+	}
+	loop_timer_set(t, DEVICE_SUB_SAMPLE);
+}
+
+static void device_polled(Device *dev);
+
+/* GETs of the master keep the sensor a slave, a new or stale text is acked
+ * by a push at once. */
+static int peer_upstream_recv(Peer *p)
+{
+	Device *dev = p->dev;
+	int rc, ack = 0, got = 0;
+	ProtoHdr h;
+
+	while ((rc = proto_frame_check(p->buf, p->off, p->size, &h)) == 0) {
+		const uint8_t *q = p->buf + PROTO_HDR_SIZE;
+
+		if (h.type != MSG2_GET) {
+			return -1;
+		}
+		int flags = device_get2_apply(dev, q, h.len - PROTO_FRAME_MIN);
+		if (flags < 0) {
+			return -1;
+		}
+		ack |= flags || (q[0] & GET2_F_TEXT);
+		got = 1;
+
+		p->off -= h.len;
+		memmove(p->buf, p->buf + h.len, p->off);
+	}
+	if (rc < 0) {
+		return -1;
+	}
+
+	if (got) {
+		device_polled(dev);
+	}
+	return ack ? device_upstream_push(dev) : 0;
+}
+
+static void peer_on_upstream_drop(Peer *p, int eof)
+{
+	UNUSED(eof);
+	assert(p == p->dev->up.p);
+	warnx("UNSUBSCRIBED");
+	device_upstream_close(p->dev);
+}
+
+/* The master subscribes on the connection it polled. A sensor has a single
+ * master, another one is refused until the subscription is gone. */
+static int peer_sub_req_recv(Peer *p, const ProtoHdr *h)
+{
+	Device *dev = p->dev;
+	DeviceUpstream *up = &dev->up;
+	const uint8_t *q = p->buf + PROTO_HDR_SIZE;
+
+	static const PeerVtable vtable = {
+		peer_upstream_recv,	/* on_in */
+		NULL,			/* on_out */
+		peer_on_upstream_drop,	/* on_drop */
+	};
+
+	if (h->len != PROTO_FRAME_MIN + SUB2_SIZE) {
+		return -1;
+	}
+
+	if (up->p != NULL) {
+		warnx("SUBSCRIBE refused, subscribed already");
+		return -1;
+	}
+	up->p = p;
+	up->id = h->id;
+	up->deadband = get_le16(q);
+	up->heartbeat = get_le16(q + 2);
+	if (up->heartbeat < DEVICE_SUB_SAMPLE) {
+		up->heartbeat = DEVICE_SUB_SAMPLE;
+	} else if (up->heartbeat > DEVICE_SUB_HEARTBEAT_MAX) {
+		up->heartbeat = DEVICE_SUB_HEARTBEAT_MAX;
+	}
+	peer_vtable_set(p, &vtable);
+	warnx("SUBSCRIBED deadband %d, heartbeat %d ms",
+			up->deadband, up->heartbeat);
+
+	/* GETs might be pipelined after SUB, pushes are queued after them. */
+	memcpy(p->buf, p->buf + p->size, p->spill);
+	p->off = p->spill;
+	p->spill = 0;
+
+	/* A master which doesn't poll for so long is gone. */
+	p->timeout = DEVICE_SLAVE_TIMEOUT;
+	loop_timer_set(&p->deadline, p->timeout);
+
+	/* The first push is the current reading. */
+	device_reading_gen(dev, &up->temp, &up->brgth);
+	if (device_upstream_push(dev) < 0) {
+		return -1;
+	}
+	loop_timer_set(&up->timer, DEVICE_SUB_SAMPLE);
+
+	return p->off ? peer_upstream_recv(p) : 0;
+}
+
+static void peer_on_srv_drop(Peer *p, int eof);
+static int peer_msg_req_recv(Peer *p);
+
+static int peer_msg2_req_recv(Peer *p)
+{
+	ProtoHdr h;
+	int rc;
+
+	rc = proto_frame_check(p->buf, p->off, p->size, &h);
+	if (rc != 0) {
+		return rc;
+	}
+
+	/* Put aside bytes of the next frames, buf is reused for reply. */
+	p->spill = p->off - h.len;
+	memcpy(p->buf + p->size, p->buf + h.len, p->spill);
+
+	switch (h.type) {
+	case MSG2_HELLO:
+		rc = peer_hello2_req_recv(p, &h);
+		break;
+	case MSG2_GET:
+		rc = peer_get2_req_recv(p, &h);
+		break;
+	case MSG2_SUB:
+		/* The connection stays with the subscription, no reply. */
+		return peer_sub_req_recv(p, &h);
+	default:
+		rc = -1;
+		break;
+	}
+
+	if (rc < 0) {
+		return rc;
+	}
+
+	static const PeerVtable vtable = {
+		peer_msg_req_recv,	/* on_in */
+		peer_msg2_after_write,	/* on_out */
+		peer_on_srv_drop,	/* on_drop */
+	};
+
+	peer_vtable_set(p, &vtable);
+	loop_fd_change(p->fd, LOOP_WR);
+	return 0;
+}
+
+static void device_polled(Device *dev)
+{
+	if (dev->state != DEV_STATE_SLAVE) {
+		/* In unknown and master states the device can poll sensors,
+		 * since someone polls us the device is a slave stop polling */
+		if (device_is_polling_inprogress(dev)) {
+			device_drop_peers(dev);
+		}
+
+		warnx("%s -> SLAVE", device_state2name(dev));
+		device_state_set(dev, DEV_STATE_SLAVE);
+		device_display(dev, 1);
+	}
+
+	assert(dev->state == DEV_STATE_SLAVE);
+	device_step_defer(dev);
+}
+
+static int peer_msg_req_recv(Peer *p)
+{
+	Device *dev = p->dev;
+	unsigned char type = *p->buf;
+	int rc = -1;
+
+	switch (type) {
+	case MSG_HELLO:
+		rc = peer_hello_req_recv(p);
+		break;
+	case MSG_GET:
+		rc = peer_get_req_recv(p);
+		break;
+	case MSG2_HELLO:
+	case MSG2_GET:
+	case MSG2_SUB:
+		/* Nodes limited to v1 drop v2 frames like v1 nodes do. */
+		if (dev->proto_max >= PROTO_V2) {
+			rc = peer_msg2_req_recv(p);
+		}
+		break;
+	default:
+		rc = -1;
+		break;
+	}
+
+	if (rc != 0) {
+		/* rc might be 1 (partial read) and -1 (error) */
+		return rc < 0 ? rc : 0;
+	}
+
+	/* HELLO is echoed and doesn't influence on the state. */
+	if (type == MSG_HELLO || type == MSG2_HELLO) {
+		return 0;
+	}
+
+	device_polled(dev);
+	return 0;
+}
+
+/* Polled peers are retired when they make no progress in time. */
+static void peer_deadline_touch(Peer *p)
+{
+	if (loop_timer_active(&p->deadline)) {
+		loop_timer_set(&p->deadline, p->timeout);
+	}
+}
+
+/* Queued frames of a subscription go out apart from the exchange in buf. */
+static int peer_queue_send(Peer *p)
+{
+	unsigned char *q = p->buf + p->size;
+	int m = p->qlen - p->qoff;
+#ifdef FUZZ_IO
+	m = 1 + rand() % m;
+#endif
+	ssize_t n = send(p->fd, q + p->qoff, m, 0);
+	if (n < 0) {
+		return SOFT_ERROR ? 0 : -1;
+	}
+
+	PROBE3(peer_send, p->fd, p->addr, n);
+	device_capture(p->dev, CAP_OUT, p->fd, p->addr, q + p->qoff, n);
+	p->qoff += n;
+	if (p->qoff == p->qlen) {
+		p->qoff = p->qlen = 0;
+		loop_fd_change(p->fd, LOOP_RD);
+	}
+	return 0;
+}
+
+static void peer_rdwr_event(int fd, LoopEvent event, void *opaque)
+{
+	Peer *p = opaque;
+	int eof = 0;
+
+	if (event & LOOP_ERR) {
+		goto drop;
+	}
+
+	if ((event & LOOP_WR) && p->qlen) {
+		if (peer_queue_send(p) < 0) {
+			goto drop;
+		}
+		event &= ~LOOP_WR;
+	}
+
+
+	if (event & LOOP_RD) {
+		int m = p->size - p->off;
+#ifdef FUZZ_IO
+		m = 1 + rand() % m;
+#endif
+		ssize_t n = recv(fd, p->buf + p->off, m, 0);
+		if (n <= 0) {
+			if (n == 0 || (n < 0 && !SOFT_ERROR)) {
+				eof = n == 0 ? 1 : 0;
+				goto drop;
+			}
+		} else {
+			PROBE3(peer_recv, fd, p->addr, n);
+			device_capture(p->dev, CAP_IN, fd, p->addr,
+					p->buf + p->off, n);
+			p->off += n;
+			peer_deadline_touch(p);
+			if (p->v->on_in(p) < 0) {
+				goto drop;
+			}
+		}
+	} else if (event & LOOP_WR) {
+		int m = p->left;
+#ifdef FUZZ_IO
+		m = 1 + rand() % m;
+#endif
 		ssize_t n = send(fd, p->buf + p->off, m, 0);
 		if (n < 0) {
 			if (n < 0 && !SOFT_ERROR) {
 				goto drop;
 			}
 		} else {
+			PROBE3(peer_send, fd, p->addr, n);
+			device_capture(p->dev, CAP_OUT, fd, p->addr,
+					p->buf + p->off, n);
 			p->off  += n;
+			peer_deadline_touch(p);
 			p->left -= n;
 			if (!p->left) {
 				if (p->v->on_out == NULL) {
@@ -443,20 +1053,128 @@ drop:
 	p->v->on_drop(p, eof);
 }
 
+/* Halve the window on congestion but not more than once per cycle. */
+static void device_fanout_backoff(Device *dev)
+{
+	DeviceFanout *f = &dev->fanout;
+
+	if (f->backoff) {
+		return;
+	}
+
+	f->backoff = 1;
+	f->acks = 0;
+	f->window = f->window / 2 < DEVICE_FANOUT_MIN ?
+			DEVICE_FANOUT_MIN : f->window / 2;
+	dev->stats.window = f->window;
+	dev->stats.congestions++;
+	warnx("FANOUT window %d", f->window);
+}
+
+/* Grow the window by one after a window worth of fast replies. */
+static void device_fanout_ack(Device *dev, const Peer *p)
+{
+	DeviceFanout *f = &dev->fanout;
+	int latency = clock_msec() - p->start;
+
+	dev->stats.latency = latency;
+	if (latency > DEVICE_FANOUT_LATENCY) {
+		device_fanout_backoff(dev);
+		return;
+	}
+
+	if (++f->acks >= f->window && f->window < f->window_max) {
+		f->acks = 0;
+		dev->stats.window = ++f->window;
+	}
+}
+
+static void device_finish_poll_peer(Device *dev, Peer *p, int park)
+{
+	device_detach_peer(dev, p, park);
+	if (!device_is_polling_inprogress(dev)) {
+		device_poll_cycle_done(dev);
+	}
+}
+
+static void device_drop_poll_peer(Device *dev, Peer *p)
+{
+	device_finish_poll_peer(dev, p, 0);
+}
+
+/* v1 nodes close connections with v2 frames without a reply. */
+static int peer_is_v1_drop(const Peer *p, int eof)
+{
+	return p->proto == PROTO_V2 && eof && p->off == 0 ? 1 : 0;
+}
+
+static void device_connect(Device *dev, int addr);
+
+/* Poll the address of the dropped peer again in its slot, the cycle is
+ * finished only when the new connection can't be opened. */
+static void device_repoll_peer(Device *dev, Peer *p)
+{
+	int addr = p->addr;
+
+	PROBE3(peer_detach, p->fd, addr, 0);
+	device_unlink_peer(dev, p);
+	peer_close(p);
+	device_connect(dev, addr);
+	device_dispatch(dev);
+	if (!device_is_polling_inprogress(dev)) {
+		device_poll_cycle_done(dev);
+	}
+}
+
 static void peer_on_poll_drop(Peer *p, int eof)
 {
 	Device *dev = p->dev;
-	UNUSED(eof);
 	assert(dev->state == DEV_STATE_MASTER ||
 			dev->state == DEV_STATE_CONTROLLER);
-	device_drop_peer(dev, p);
+	/* The idle connection was closed by the peer, open a new one. */
+	if (p->reused) {
+		device_repoll_peer(dev, p);
+		return;
+	}
+	/* The node might be downgraded, negotiate the version again. */
+	if (peer_is_v1_drop(p, eof)) {
+		dev->proto[p->addr] = 0;
+	}
+	/* A peer which failed in the middle of the exchange. */
+	device_fanout_backoff(dev);
+	device_drop_poll_peer(dev, p);
+}
+
+static void peer_on_poll_hello2_drop(Peer *p, int eof)
+{
+	Device *dev = p->dev;
+
+	if (!peer_is_v1_drop(p, eof)) {
+		peer_on_poll_drop(p, eof);
+		return;
+	}
+
+	/* Poll the v1 node again in this cycle before the peer is dropped
+	 * otherwise the cycle might be finished. */
+	dev->proto[p->addr] = PROTO_V1;
+	device_repoll_peer(dev, p);
 }
 
+static void device_slave_resolve(Device *dev);
+
 static void peer_on_poll_hello_drop(Peer *p, int eof)
 {
 	Device *dev = p->dev;
-	UNUSED(eof);
 	assert(dev->state == DEV_STATE_UNKNOWN);
+
+	/* The v1 node is alive but it doesn't understand v2 HELLO. */
+	if (peer_is_v1_drop(p, eof)) {
+		dev->proto[p->addr] = PROTO_V1;
+		device_drop_peers(dev);
+		device_slave_resolve(dev);
+		return;
+	}
+
 	device_drop_peer(dev, p);
 	device_master_resolve(dev);
 }
@@ -467,6 +1185,30 @@ static void peer_on_srv_drop(Peer *p, int eof)
 	peer_close(p);
 }
 
+/* A straggler is retired alone, the rest of the cycle goes on. */
+static void peer_deadline_tick(LoopTimer *t, void *opaque)
+{
+	Peer *p = opaque;
+	Device *dev = p->dev;
+
+	UNUSED(t);
+	warnx("TIMEOUT %d", p->addr);
+	dev->stats.timeouts++;
+	/* A stuck idle connection is not reconnected. */
+	p->reused = 0;
+
+	if (p->v != NULL) {
+		p->v->on_drop(p, 0);
+	} else if (dev->state == DEV_STATE_UNKNOWN) {
+		/* Connecting to a node with a higher address. */
+		device_drop_peer(dev, p);
+		device_master_resolve(dev);
+	} else {
+		device_fanout_backoff(dev);
+		device_drop_poll_peer(dev, p);
+	}
+}
+
 static int peer_close_after_write(Peer *p)
 {
 	peer_close(p);
@@ -481,17 +1223,17 @@ static void device_srv_event(int fd, LoopEvent event, void *opaque)
 		return;
 	}
 
-	int afd = unix_accept(fd, 1);
+	int afd = dev->tr->accept(fd, 1);
 	if (afd < 0) {
 		if (!SOFT_ERROR) {
-			warn("unix_accept()");
+			warn("accept()");
 		}
 		return;
 	}
 
 	Peer *p = peer_alloc(afd, dev);
 	if (p == NULL) {
-		close(afd);
+		loop_fd_close(afd);
 		return;
 	}
 
@@ -505,310 +1247,1414 @@ static void device_srv_event(int fd, LoopEvent event, void *opaque)
 	loop_fd_add(afd, LOOP_RD, peer_rdwr_event, p);
 }
 
-static int device_params_put(Device *dev, uint16_t temp, uint16_t brgth)
-{
-	Param param = { temp, brgth };
+static void
+device_reading_put(Device *dev, int addr, uint16_t temp, uint16_t brgth)
+{
+	DeviceReadings *r = &dev->readings;
+
+	r->temp[addr] = r->temp_min[addr] = r->temp_max[addr] = temp;
+	r->brgth[addr] = r->brgth_min[addr] = r->brgth_max[addr] = brgth;
+	r->seen[addr] = dev->stats.cycles;
+	r->valid[addr / 64] |= (uint64_t)1 << (addr % 64);
+}
+
+/* The mean of the summary is the reading, its bounds count in the cycle
+ * bounds. The last sample isn't used by the master. */
+static void device_summary_put(Device *dev, int addr, const uint8_t *q)
+{
+	DeviceReadings *r = &dev->readings;
+
+	device_reading_put(dev, addr, get_le16(q + 2), get_le16(q + 10));
+	r->temp_min[addr] = get_le16(q + 4);
+	r->temp_max[addr] = get_le16(q + 6);
+	r->brgth_min[addr] = get_le16(q + 12);
+	r->brgth_max[addr] = get_le16(q + 14);
+	dev->stats.samples += get_le16(q);
+}
+
+static int peer_check_connection(const Peer *p)
+{
+	return p->dev->tr->check_connection(p->fd);
+}
+
+static void device_master_resolve(Device *dev)
+{
+	assert(dev->state == DEV_STATE_UNKNOWN);
+
+	/* Can't resolve to MASTER when other peers are still polled. */
+	if (device_is_polling_inprogress(dev)) {
+		return;
+	}
+
+	device_state_set(dev, DEV_STATE_MASTER);
+	warnx("%u is %s", dev->host, device_state2name(dev));
+	device_display(dev, 1);
+	device_step_defer(dev);
+}
+
+static void device_slave_resolve(Device *dev)
+{
+	assert(dev->state == DEV_STATE_UNKNOWN);
+	device_state_set(dev, DEV_STATE_SLAVE);
+	warnx("%u is %s", dev->host, device_state2name(dev));
+	device_display(dev, 1);
+	device_step_defer(dev);
+}
+
+/* Check v2 HELLO reply: 1 - partial, 0 - valid, -1 - error. */
+static int peer_hello2_resp_check(Peer *p)
+{
+	Device *dev = p->dev;
+	ProtoHdr h;
+
+	int rc = proto_frame_check(p->buf, p->off, p->size, &h);
+	if (rc != 0) {
+		return rc;
+	}
+
+	uint8_t ver = p->buf[PROTO_HDR_SIZE];
+	if (h.type != MSG2_HELLO || h.id != p->id ||
+			h.len != PROTO_FRAME_MIN + 1 || ver < PROTO_V2) {
+		return -1;
+	}
+
+	dev->proto[p->addr] = ver < dev->proto_max ? ver : dev->proto_max;
+	return 0;
+}
+
+static int peer_hello_resp_recv(Peer *p)
+{
+	Device *dev = p->dev;
+	int ok;
+
+	assert(dev->state == DEV_STATE_UNKNOWN);
+
+	if (p->proto == PROTO_V2) {
+		int rc = peer_hello2_resp_check(p);
+		if (rc > 0) {
+			return 0;
+		}
+		ok = rc == 0;
+	} else {
+		ok = p->off == 1 && *p->buf == MSG_HELLO;
+	}
+
+	/* Someone with the higher address replied then drop all
+	 * other polling peers cause we don't need their results. */
+	if (ok) {
+		device_drop_peers(dev);
+		device_slave_resolve(dev);
+	} else {
+		device_drop_peer(dev, p);
+		device_master_resolve(dev);
+	}
+
+	return 0;
+}
+
+/* Replies of peers carried from a previous cycle count in this one. */
+static void device_peer_late(Device *dev, const Peer *p)
+{
+	if (p->cycle != dev->stats.cycles) {
+		dev->stats.late++;
+	}
+}
+
+static int peer_get_resp_recv(Peer *p)
+{
+	Device *dev = p->dev;
+	const TlvValue *params = p->dec.vals;
+
+	int rc = peer_tlv_decode(p, &proto_res_schema);
+	if (rc != 0) {
+		return rc;
+	}
+
+	device_reading_put(dev, p->addr,
+			params[RES_TEMP].u16, params[RES_BRGHT].u16);
+	device_peer_late(dev, p);
+	device_fanout_ack(dev, p);
+	device_drop_poll_peer(dev, p);
+
+	return 0;
+}
+
+static Peer *device_sub_find(const Device *dev, int addr)
+{
+	return dev->subbed[addr / 64] >> (addr % 64) & 1 ?
+		dev->subs[addr] : NULL;
+}
+
+static void device_sub_remove(Device *dev, Peer *p)
+{
+	dev->subbed[p->addr / 64] &= ~(1ULL << (p->addr % 64));
+	dev->subs[p->addr] = NULL;
+	peer_close(p);
+}
+
+static void device_subs_close(Device *dev)
+{
+	int w;
+
+	for (w = 0; w < DEVICE_READINGS_WORDS; w++) {
+		uint64_t bits = dev->subbed[w];
+
+		while (bits) {
+			int i = w * 64 + __builtin_ctzll(bits);
+
+			bits &= bits - 1;
+			device_sub_remove(dev, dev->subs[i]);
+		}
+	}
+}
+
+/* Send the text when it is not delivered yet or a keepalive GET, the next
+ * keepalive is a heartbeat after any GET. */
+static int device_sub_notify(Device *dev, Peer *p)
+{
+	uint8_t buf[PEER_BUF_SIZE];
+	size_t n = device_get2_build(dev, p->addr, buf, p->id, &p->epoch);
+
+	loop_timer_set(&p->keepalive, dev->sub_heartbeat);
+	return peer_frame_push(p, buf, n);
+}
+
+/* Keepalives keep the sensor a slave regardless of the polling interval. */
+static void peer_keepalive_tick(LoopTimer *t, void *opaque)
+{
+	Peer *p = opaque;
+
+	UNUSED(t);
+	if (device_sub_notify(p->dev, p) < 0) {
+		device_sub_remove(p->dev, p);
+	}
+}
+
+static int peer_sub_push_recv(Peer *p)
+{
+	Device *dev = p->dev;
+	ProtoHdr h;
+	int rc;
+
+	while ((rc = proto_frame_check(p->buf, p->off, p->size, &h)) == 0) {
+		const uint8_t *q = p->buf + PROTO_HDR_SIZE;
+
+		if (h.type != MSG2_PUSH || h.id != p->id ||
+		    h.len != PROTO_FRAME_MIN + PUSH2_SIZE) {
+			return -1;
+		}
+		device_reading_put(dev, p->addr, get_le16(q), get_le16(q + 2));
+		dev->msg_acked[p->addr] = get_le32(q + 4);
+		dev->stats.pushes++;
+		p->pushes++;
+
+		p->off -= h.len;
+		memmove(p->buf, p->buf + h.len, p->off);
+	}
+	if (rc < 0) {
+		return -1;
+	}
+
+	/* The current text is not sent on the connection yet. */
+	if (dev->net_msg_len && p->epoch != dev->msg_epoch &&
+	    dev->msg_acked[p->addr] != dev->msg_epoch) {
+		return device_sub_notify(dev, p);
+	}
+	return 0;
+}
+
+/* A sensor closes the subscription before the first push when it has
+ * another master, it is polled for a while before the next try. */
+static void peer_on_sub_drop(Peer *p, int eof)
+{
+	Device *dev = p->dev;
+
+	UNUSED(eof);
+	warnx("UNSUB %d", p->addr);
+	if (!p->pushes) {
+		dev->sub_retry[p->addr] = dev->stats.cycles + DEVICE_SUB_RETRY;
+	}
+	device_sub_remove(dev, p);
+}
+
+/* A polled v2 sensor stays on the connection and pushes its readings
+ * instead of being polled every cycle. */
+static void device_sub_start(Device *dev, Peer *p)
+{
+	uint8_t buf[PROTO_FRAME_MIN + SUB2_SIZE];
+	uint8_t *q = proto_frame_begin(buf, MSG2_SUB, p->id = ++dev->req_id);
+
+	static const PeerVtable vtable = {
+		peer_sub_push_recv,	/* on_in */
+		NULL,			/* on_out */
+		peer_on_sub_drop,	/* on_drop */
+	};
+
+	put_le16(q, dev->sub_deadband);
+	put_le16(q + 2, dev->sub_heartbeat);
+
+	PROBE3(peer_detach, p->fd, p->addr, 1);
+	device_unlink_peer(dev, p);
+	if (peer_frame_push(p, buf, proto_frame_end(buf, SUB2_SIZE)) < 0) {
+		peer_close(p);
+	} else {
+		peer_vtable_set(p, &vtable);
+		p->off = 0;
+		p->start = clock_msec();
+		/* Pushes come at least once per heartbeat. */
+		p->timeout = dev->sub_heartbeat + dev->peer_timeout;
+		loop_timer_set(&p->deadline, p->timeout);
+		loop_timer_set(&p->keepalive, dev->sub_heartbeat);
+		dev->subs[p->addr] = p;
+		dev->subbed[p->addr / 64] |= 1ULL << (p->addr % 64);
+		warnx("SUB %d", p->addr);
+	}
+
+	device_dispatch(dev);
+	if (!device_is_polling_inprogress(dev)) {
+		device_poll_cycle_done(dev);
+	}
+}
+
+/* Subscribed sensors count in every cycle with their last pushed readings,
+ * those out of the polled range are unsubscribed. */
+static void device_subs_refresh(Device *dev, const Range *range, int excl)
+{
+	int w;
+
+	for (w = 0; w < DEVICE_READINGS_WORDS; w++) {
+		uint64_t bits = dev->subbed[w];
+
+		while (bits) {
+			int i = w * 64 + __builtin_ctzll(bits);
+			Peer *p = dev->subs[i];
+
+			bits &= bits - 1;
+			if (i < range->from || i > range->to || i == excl) {
+				device_sub_remove(dev, p);
+				continue;
+			}
+			device_reading_put(dev, i, dev->readings.temp[i],
+					dev->readings.brgth[i]);
+			if (dev->net_msg_len &&
+			    dev->msg_acked[i] != dev->msg_epoch) {
+				if (device_sub_notify(dev, p) < 0) {
+					device_sub_remove(dev, p);
+				}
+			}
+		}
+	}
+}
+
+static int peer_get2_resp_recv(Peer *p)
+{
+	Device *dev = p->dev;
+	ProtoHdr h;
+	int i;
+
+	int rc = proto_frame_check(p->buf, p->off, p->size, &h);
+	if (rc != 0) {
+		return rc;
+	}
+
+	uint8_t *q = p->buf + PROTO_HDR_SIZE;
+	size_t n = h.len - PROTO_FRAME_MIN;
+	int count = q[0], summary = q[1] & RES2_F_SUMMARY;
+	uint32_t t = 0, b = 0;
+
+	if (h.type != MSG2_RES || h.id != p->id || !count ||
+			n != RES2_FIXED_SIZE + (summary ? RES2_SUMMARY_SIZE :
+				(size_t)count * RES2_READING_SIZE)) {
+		return -1;
+	}
+
+	/* Remember the delivered epoch or resend the text next time. */
+	dev->msg_acked[p->addr] = q[1] & RES2_F_STALE ? 0 : p->epoch;
+
+	/* A batch is kept as the mean reading of the sensor. */
+	q += RES2_FIXED_SIZE;
+	if (summary) {
+		device_summary_put(dev, p->addr, q);
+	} else {
+		for (i = 0; i < count; i++, q += RES2_READING_SIZE) {
+			t += get_le16(q);
+			b += get_le16(q + 2);
+		}
+		device_reading_put(dev, p->addr, t / count, b / count);
+	}
+
+	device_peer_late(dev, p);
+	device_fanout_ack(dev, p);
+	if (dev->sub_deadband >= 0 &&
+	    (int)(dev->stats.cycles - dev->sub_retry[p->addr]) >= 0) {
+		device_sub_start(dev, p);
+		return 0;
+	}
+	device_finish_poll_peer(dev, p, 1);
+
+	return 0;
+}
+
+static int peer_rd_after_wr(Peer *p)
+{
+	p->off = 0;
+	p->dec.schema = NULL;
+	loop_fd_change(p->fd, LOOP_RD);
+	return 0;
+}
+
+static void device_connect(Device *dev, int addr)
+{
+	int fd = dev->idle[addr], reused = fd != -1;
+
+	/* A peer carried from the previous cycle is still polled. */
+	if (device_peer_find(dev, addr) != NULL) {
+		dev->stats.inflight_dups++;
+		return;
+	}
+
+	dev->idle[addr] = -1;
+	if (!reused) {
+		fd = dev->tr->connect(addr, 1);
+	}
+	if (fd < 0) {
+		/* Missing or refused sensors are not congestion signals. */
+		if (errno == EAGAIN || errno == EMFILE ||
+		    errno == ENFILE || errno == ENOBUFS) {
+			device_fanout_backoff(dev);
+		}
+		return;
+	}
+
+	/* A subscribed sensor is not polled, its peer keeps the slot. */
+	assert(device_sub_find(dev, addr) == NULL);
+	/* Set vtable when connection is established. */
+	Peer *p = peer_pool_get(dev, fd, addr);
+	p->start = clock_msec();
+	p->reused = reused;
+	p->cycle = dev->stats.cycles;
+	p->timeout = dev->peer_timeout;
+	loop_timer_set(&p->deadline, p->timeout);
+	PROBE3(peer_connect_start, p->fd, addr, reused);
+	dev->active[addr / 64] |= 1ULL << (addr % 64);
+	dev->fanout.inflight++;
+	loop_fd_add(p->fd, LOOP_WR, dev->fanout.on_connect, p);
+}
+
+static int device_member_live(const Device *dev, int addr, int64_t now)
+{
+	return dev->member_seen[addr] &&
+		now - dev->member_seen[addr] <= DEVICE_MEMBER_TTL ? 1 : 0;
+}
+
+/* Only live members which accept connections are polled. */
+static int device_member_pollable(const Device *dev, int addr, int64_t now)
+{
+	return device_member_live(dev, addr, now) &&
+		dev->member_role[addr] != DEV_STATE_CONTROLLER ? 1 : 0;
+}
+
+static void device_dispatch(Device *dev)
+{
+	DeviceFanout *f = &dev->fanout;
+	int last = f->allow < f->to ? f->allow : f->to;
+	int64_t now = clock_msec();
+
+	while (f->next <= last && f->inflight < f->window) {
+		int i = f->next++;
+		/* Addresses without a socket file are skipped at once. */
+		if (dev->watch != NULL && !dirwatch_has(dev->watch, i)) {
+			i = dirwatch_next(dev->watch, i);
+			if (i < 0 || i > last) {
+				f->next = last + 1;
+				break;
+			}
+			f->next = i + 1;
+		}
+		if (i == f->excl) {
+			continue;
+		}
+		if (f->members && !device_member_pollable(dev, i, now)) {
+			continue;
+		}
+		if (dev->shm_read[i] || device_sub_find(dev, i) != NULL) {
+			continue;
+		}
+		if (f->restored &&
+		    !(dev->snap_members[i / 64] >> (i % 64) & 1)) {
+			continue;
+		}
+		device_connect(dev, i);
+	}
+}
+
+static int stagger_jitter(int slot)
+{
+	return slot / 2 + rand() % (slot + 1);
+}
+
+static void device_dispatch_tick(LoopTimer *t, void *opaque)
+{
+	Device *dev = opaque;
+	DeviceFanout *f = &dev->fanout;
+
+	f->allow += f->step;
+	device_dispatch(dev);
+	if (f->allow < f->to) {
+		loop_timer_set(t, stagger_jitter(f->slot));
+	}
+}
+
+/* Spread the range over 3/4 of the interval, the rest is left to finish. */
+static void device_stagger(Device *dev, const Range *range, int interval)
+{
+	DeviceFanout *f = &dev->fanout;
+	int n = range->to - range->from + 1;
+	int spread = interval * 3 / 4;
+
+	f->slot = spread / n;
+	f->step = 1;
+	if (f->slot < DEVICE_STAGGER_TICK) {
+		f->slot = DEVICE_STAGGER_TICK;
+		f->step = (n * DEVICE_STAGGER_TICK + spread - 1) / spread;
+	}
+
+	f->allow = range->from + f->step - 1;
+	loop_timer_set(&f->timer, stagger_jitter(f->slot));
+}
+
+static void
+device_connect_range(Device *dev, const Range *range, int excl, int stagger,
+			void (*on_connect)(int fd, LoopEvent e, void *opaque))
+{
+	DeviceFanout *f = &dev->fanout;
+
+	f->next = range->from;
+	f->to = range->to;
+	f->allow = range->to;
+	f->excl = excl;
+	f->backoff = 0;
+	f->on_connect = on_connect;
+	loop_timer_cancel(&f->timer);
+
+	if (stagger && range->from < range->to) {
+		device_stagger(dev, range, stagger);
+	}
+
+	device_dispatch(dev);
+}
+
+static void
+peer_master_or_slave_on_connect(int fd, LoopEvent event, void *opaque)
+{
+	Peer *p = opaque;
+	Device *dev = p->dev;
+
+	assert(dev->state == DEV_STATE_UNKNOWN);
+	UNUSED(event);
+
+	static const PeerVtable vtable = {
+		peer_hello_resp_recv,	/* on_in */
+		peer_rd_after_wr,	/* on_out */
+		peer_on_poll_hello_drop,
+	};
+
+	/* If connection was success send hello request. */
+	int ok = peer_check_connection(p);
+	PROBE3(peer_connect_done, fd, p->addr, ok);
+	if (ok) {
+		loop_fd_del(fd);
+		peer_vtable_set(p, &vtable);
+		p->proto = device_peer_proto(dev, p->addr) == PROTO_V1 ?
+				PROTO_V1 : PROTO_V2;
+		peer_hello_req_send(p);
+		loop_fd_add(p->fd, LOOP_WR, peer_rdwr_event, p);
+	} else {
+		device_drop_peer(dev, p);
+		device_master_resolve(dev);
+	}
+}
+
+static void device_announce(Device *dev, int flags)
+{
+	DiscoveryMsg m;
+
+	memset(&m, 0, sizeof(m));
+	m.flags = flags;
+	m.role = dev->state;
+	m.host = dev->host;
+	m.epoch = dev->state == DEV_STATE_MASTER ||
+		  dev->state == DEV_STATE_CONTROLLER ? dev->msg_epoch : 0;
+
+	if (discovery_send(dev->disc_fd, &m) < 0) {
+		warn("discovery_send()");
+	}
+	dev->disc_state = dev->state;
+}
+
+static void device_announce_tick(LoopTimer *t, void *opaque)
+{
+	device_announce(opaque, 0);
+	loop_timer_set(t, DEVICE_ANNOUNCE_PERIOD);
+}
+
+static void device_discovery_event(int fd, LoopEvent event, void *opaque)
+{
+	Device *dev = opaque;
+	int64_t now = clock_msec();
+	DiscoveryMsg m;
+	int query = 0;
+
+	UNUSED(event);
+
+	while (discovery_recv(fd, &m) > 0) {
+		/* Own datagrams are looped back. */
+		if (m.host == dev->host) {
+			continue;
+		}
+		if (m.flags & DISC_F_LEAVE) {
+			dev->member_seen[m.host] = 0;
+			dev->shard_seen[m.host] = 0;
+			continue;
+		}
+		dev->member_seen[m.host] = now;
+		dev->member_role[m.host] = m.role;
+		if (m.flags & DISC_F_AGGR) {
+			dev->shard_aggr[m.host] = m.aggr;
+			dev->shard_seen[m.host] = now;
+		}
+		query |= m.flags & DISC_F_QUERY;
+	}
+
+	/* A single reply to all queries of the batch. */
+	if (query) {
+		device_announce(dev, 0);
+	}
+}
+
+/* The announces are collected, a live controller or a node with a higher
+ * address polls us, otherwise the device is the master. */
+static void device_elect_tick(LoopTimer *t, void *opaque)
+{
+	Device *dev = opaque;
+	int64_t now = clock_msec();
+	int i;
+
+	UNUSED(t);
+
+	if (dev->state != DEV_STATE_UNKNOWN) {
+		return;
+	}
+
+	for (i = 0; i <= DEVICE_HOST_ADDR_MAX; i++) {
+		if (device_member_live(dev, i, now) &&
+		    (i > dev->host ||
+		     dev->member_role[i] == DEV_STATE_CONTROLLER)) {
+			device_slave_resolve(dev);
+			return;
+		}
+	}
+
+	device_master_resolve(dev);
+}
+
+static void device_watch_event(int fd, LoopEvent event, void *opaque)
+{
+	Device *dev = opaque;
+
+	UNUSED(fd);
+	if (!(event & LOOP_RD)) {
+		return;
+	}
+
+	int n = dirwatch_read(dev->watch);
+	if (n < 0) {
+		warn("dirwatch_read()");
+		return;
+	}
+	if (n) {
+		warnx("WATCH %d sockets", dirwatch_count(dev->watch));
+		/* A socket which appeared ahead of the cycle is polled. */
+		device_dispatch(dev);
+	}
+}
+
+static void device_master_or_slave(Device *dev)
+{
+	/* A single query instead of connecting to every address. */
+	if (dev->disc_fd != -1) {
+		device_announce(dev, DISC_F_QUERY);
+		loop_timer_set(&dev->elect_timer, DEVICE_DISCOVERY_WAIT);
+		return;
+	}
+
+	/* Connect to addresses that are greater to detect the device role. */
+	const Range range = {
+		dev->host + 1, DEVICE_HOST_ADDR_MAX
+	};
+
+	dev->fanout.members = 0;
+	memset(dev->shm_read, 0, sizeof(dev->shm_read));
+	device_connect_range(dev, &range, -1, 0,
+				peer_master_or_slave_on_connect);
+	device_master_resolve(dev);
+}
+
+/* The version is negotiated, send v2 GET on the same connection. */
+static int peer_poll_hello2_recv(Peer *p)
+{
+	int rc = peer_hello2_resp_check(p);
+	if (rc != 0) {
+		return rc;
+	}
+
+	static const PeerVtable vtable = {
+		peer_get2_resp_recv,	/* on_in */
+		peer_rd_after_wr,	/* on_out */
+		peer_on_poll_drop,
+	};
+
+	peer_vtable_set(p, &vtable);
+	peer_get2_req_send(p);
+	loop_fd_change(p->fd, LOOP_WR);
+	return 0;
+}
+
+static void peer_poll_on_connect(int fd, LoopEvent event, void *opaque)
+{
+	Peer *p = opaque;
+	Device *dev = p->dev;
+
+	UNUSED(event);
+
+	static const PeerVtable vtable = {
+		peer_get_resp_recv,	/* on_in */
+		peer_rd_after_wr,	/* on_out */
+		peer_on_poll_drop,
+	};
+
+	static const PeerVtable vtable2 = {
+		peer_get2_resp_recv,	/* on_in */
+		peer_rd_after_wr,	/* on_out */
+		peer_on_poll_drop,
+	};
+
+	static const PeerVtable hello2_vtable = {
+		peer_poll_hello2_recv,	/* on_in */
+		peer_rd_after_wr,	/* on_out */
+		peer_on_poll_hello2_drop,
+	};
+
+	int ok = peer_check_connection(p);
+	PROBE3(peer_connect_done, fd, p->addr, ok);
+	if (ok) {
+		loop_fd_del(fd);
+		switch (device_peer_proto(dev, p->addr)) {
+		case PROTO_V1:
+			peer_vtable_set(p, &vtable);
+			dev->net_msg_len ?
+				peer_get_req_send(p, dev->net_msg,
+						dev->net_msg_len,
+						dev->param_avg.brgth) :
+				peer_get_req_empty_send(p);
+			break;
+		case PROTO_V2:
+			p->proto = PROTO_V2;
+			peer_vtable_set(p, &vtable2);
+			peer_get2_req_send(p);
+			break;
+		default:
+			/* The version is unknown, negotiate it first. */
+			p->proto = PROTO_V2;
+			peer_vtable_set(p, &hello2_vtable);
+			peer_hello_req_send(p);
+			break;
+		}
+		loop_fd_add(p->fd, LOOP_WR, peer_rdwr_event, p);
+	} else {
+		device_drop_poll_peer(dev, p);
+	}
+}
+
+/* A new session epoch, it is never 0 which means no message. */
+static void device_msg_epoch_reset(Device *dev)
+{
+	do {
+		dev->msg_epoch = rand();
+	} while (!dev->msg_epoch);
+	memset(dev->msg_acked, 0, sizeof(dev->msg_acked));
+}
+
+static void device_net_msg_set(Device *dev)
+{
+	char date[128], msg[sizeof(dev->net_msg)];
+	struct tm *tm;
+	time_t t;
+	int n;
+
+	time(&t);
+	tm = localtime(&t);
+
+	strftime(date, sizeof(date), "%a %b %d %R", tm);
+	n = 1 + snprintf(msg, sizeof(msg), "%u'C, %s",
+				dev->param_avg.temp, date);
+
+	/* The epoch covers the text and brightness sent with it. */
+	if (n != dev->net_msg_len || memcmp(msg, dev->net_msg, n) ||
+			dev->param_avg.brgth != dev->param_prev.brgth) {
+		memcpy(dev->net_msg, msg, n);
+		dev->net_msg_len = n;
+		if (!++dev->msg_epoch) {
+			dev->msg_epoch++;
+		}
+	}
+}
+
+typedef struct ReadingsAggr ReadingsAggr;
+
+struct ReadingsAggr {
+	unsigned	count;
+	uint32_t	temp_sum;
+	uint32_t	brgth_sum;
+	Param		min;
+	Param		max;
+};
+
+/* Masked sum of readings, min and max of their bounds over 16 addresses.
+ * The loop is branch free so the compiler vectorizes it, masked out lanes
+ * add 0 and don't move the bounds. */
+static void readings_aggr_lanes(const DeviceReadings *r, int base,
+				uint16_t bits, ReadingsAggr *a)
+{
+	const uint16_t *t = r->temp + base, *b = r->brgth + base;
+	const uint16_t *tlo = r->temp_min + base, *thi = r->temp_max + base;
+	const uint16_t *blo = r->brgth_min + base, *bhi = r->brgth_max + base;
+	static const uint16_t lane[16] = {
+		1 << 0, 1 << 1, 1 << 2, 1 << 3, 1 << 4, 1 << 5, 1 << 6, 1 << 7,
+		1 << 8, 1 << 9, 1 << 10, 1 << 11, 1 << 12, 1 << 13, 1 << 14,
+		1 << 15
+	};
+	uint32_t ts = 0, bs = 0;
+	uint16_t tmin = UINT16_MAX, tmax = 0, bmin = UINT16_MAX, bmax = 0;
+	int j;
+
+	for (j = 0; j < 16; j++) {
+		uint16_t m = bits & lane[j] ? UINT16_MAX : 0;
+		ts += t[j] & m;
+		bs += b[j] & m;
+		tmin = MIN(tmin, (uint16_t)(tlo[j] | (uint16_t)~m));
+		bmin = MIN(bmin, (uint16_t)(blo[j] | (uint16_t)~m));
+		tmax = MAX(tmax, (uint16_t)(thi[j] & m));
+		bmax = MAX(bmax, (uint16_t)(bhi[j] & m));
+	}
+
+	a->temp_sum += ts;
+	a->brgth_sum += bs;
+	a->min.temp = MIN(a->min.temp, tmin);
+	a->min.brgth = MIN(a->min.brgth, bmin);
+	a->max.temp = MAX(a->max.temp, tmax);
+	a->max.brgth = MAX(a->max.brgth, bmax);
+}
+
+static void device_readings_aggr(const DeviceReadings *r, ReadingsAggr *a)
+{
+	int w, k;
+
+	memset(a, 0, sizeof(*a));
+	a->min.temp = a->min.brgth = UINT16_MAX;
+
+	for (w = 0; w < DEVICE_READINGS_WORDS; w++) {
+		if (!r->valid[w]) {
+			continue;
+		}
+		a->count += __builtin_popcountll(r->valid[w]);
+		for (k = 0; k < 64; k += 16) {
+			readings_aggr_lanes(r, 64 * w + k,
+					r->valid[w] >> k, a);
+		}
+	}
+}
+
+/* Sensors which replied before but not in the last cycle are reported. */
+static void device_readings_report(Device *dev, const ReadingsAggr *a)
+{
+	const DeviceReadings *r = &dev->readings;
+	char buf[128];
+	int i, n = 0, missing = 0;
+
+	buf[0] = 0;
+	for (i = 0; i <= DEVICE_HOST_ADDR_MAX; i++) {
+		if (!r->seen[i] || (r->valid[i / 64] >> (i % 64) & 1)) {
+			continue;
+		}
+		if (n < (int)sizeof(buf) - 5) {
+			n += snprintf(buf + n, sizeof(buf) - n, " %d", i);
+		}
+		missing++;
+	}
+
+	dev->stats.responded = a->count;
+	dev->stats.missing = missing;
+	if (a->count) {
+		warnx("CYCLE %u: %u responded, temp [%u, %u], brigtness "
+			"[%u, %u], %d missing%s", dev->stats.cycles,
+			a->count, a->min.temp, a->max.temp, a->min.brgth,
+			a->max.brgth, missing, buf);
+	} else {
+		warnx("CYCLE %u: no replies, %d missing%s",
+			dev->stats.cycles, missing, buf);
+	}
+}
+
+/* Live controllers split the range into contiguous slices in the order of
+ * their addresses, the slices move as soon as a controller joins or leaves. */
+static void device_shard(Device *dev, Range *range)
+{
+	int64_t now = clock_msec();
+	int i, n = 0, rank = 0;
+
+	for (i = 0; i <= DEVICE_HOST_ADDR_MAX; i++) {
+		if (i == dev->host) {
+			rank = n++;
+		} else if (device_member_live(dev, i, now) &&
+			   dev->member_role[i] == DEV_STATE_CONTROLLER) {
+			n++;
+		}
+	}
+
+	range->from = rank * (DEVICE_HOST_ADDR_MAX + 1) / n;
+	range->to = (rank + 1) * (DEVICE_HOST_ADDR_MAX + 1) / n - 1;
+
+	if (n == dev->shard_n && range->from == dev->shard_from &&
+	    range->to == dev->shard_to) {
+		return;
+	}
+
+	warnx("SHARD [%d, %d] %d of %d", range->from, range->to,
+			rank + 1, n);
+	dev->shard_n = n;
+	dev->shard_from = range->from;
+	dev->shard_to = range->to;
 
-	if (dev->params_used == dev->params_size) {
-		dev->params_size = dev->params_size ? 2 * dev->params_size : 8;
-		Param *params = realloc(dev->params,
-					sizeof(Param) * dev->params_size);
-		if (params == NULL) {
-			warnx("params realloc() failed");
-			return -1;
+	/* Sensors of other slices are not missing. */
+	for (i = 0; i <= DEVICE_HOST_ADDR_MAX; i++) {
+		if (i < range->from || i > range->to) {
+			dev->readings.seen[i] = 0;
 		}
-		dev->params = params;
 	}
-
-	dev->params[dev->params_used++] = param;
-	return 0;
-}
-
-static int peer_check_connection(const Peer *p)
-{
-	return unix_check_connection(p->fd);
 }
 
-static void device_master_resolve(Device *dev)
+/* Send the aggregate of the own slice to other controllers and add their
+ * fresh partials, so every controller gets the global average. */
+static void device_shard_merge(Device *dev, ReadingsAggr *a)
 {
-	assert(dev->state == DEV_STATE_UNKNOWN);
+	int64_t now = clock_msec();
+	DiscoveryMsg m;
+	int i;
 
-	/* Can't resolve to MASTER when other peers are still polled. */
-	if (device_is_polling_inprogress(dev)) {
-		return;
+	memset(&m, 0, sizeof(m));
+	m.flags = DISC_F_AGGR;
+	m.role = dev->state;
+	m.host = dev->host;
+	m.epoch = dev->msg_epoch;
+	m.aggr.cycle = dev->stats.cycles;
+	m.aggr.count = a->count;
+	m.aggr.temp_sum = a->temp_sum;
+	m.aggr.brgth_sum = a->brgth_sum;
+	m.aggr.temp_min = a->min.temp;
+	m.aggr.temp_max = a->max.temp;
+	m.aggr.brgth_min = a->min.brgth;
+	m.aggr.brgth_max = a->max.brgth;
+
+	if (discovery_send(dev->disc_fd, &m) < 0) {
+		warn("discovery_send()");
 	}
 
-	dev->state = DEV_STATE_MASTER;
-	warnx("%u is %s", dev->host, device_state2name(dev));
-	dev->ops->display(dev, DEF_FMT, device_state2name(dev), dev->host);
-	device_next_step(dev);
-}
+	for (i = 0; i <= DEVICE_HOST_ADDR_MAX; i++) {
+		const DiscoveryAggr *p = &dev->shard_aggr[i];
 
-static void device_slave_resolve(Device *dev)
-{
-	assert(dev->state == DEV_STATE_UNKNOWN);
-	dev->state = DEV_STATE_SLAVE;
-	warnx("%u is %s", dev->host, device_state2name(dev));
-	dev->ops->display(dev, DEF_FMT, device_state2name(dev), dev->host);
-	device_next_step(dev);
+		if (!dev->shard_seen[i] || !p->count ||
+		    now - dev->shard_seen[i] > DEVICE_SHARD_TTL ||
+		    !device_member_live(dev, i, now)) {
+			continue;
+		}
+		a->count += p->count;
+		a->temp_sum += p->temp_sum;
+		a->brgth_sum += p->brgth_sum;
+		a->min.temp = MIN(a->min.temp, p->temp_min);
+		a->max.temp = MAX(a->max.temp, p->temp_max);
+		a->min.brgth = MIN(a->min.brgth, p->brgth_min);
+		a->max.brgth = MAX(a->max.brgth, p->brgth_max);
+	}
 }
 
-static int peer_hello_resp_recv(Peer *p)
+static int device_param_avg_calc(Device *dev)
 {
-	Device *dev = p->dev;
+	ReadingsAggr a;
 
-	assert(dev->state == DEV_STATE_UNKNOWN);
+	PROBE1(avg_calc_enter, dev->stats.cycles);
+	device_readings_aggr(&dev->readings, &a);
+	if (dev->stats.cycles) {
+		device_readings_report(dev, &a);
+	}
+	memset(dev->readings.valid, 0, sizeof(dev->readings.valid));
 
-	/* Someone with the higher address replied then drop all
-	 * other polling peers cause we don't need their results. */
-	if (p->off == 1 && *p->buf == MSG_HELLO) {
-		device_drop_peers(dev);
-		device_slave_resolve(dev);
-	} else {
-		device_drop_peer(dev, p);
-		device_master_resolve(dev);
+	if (dev->shard_n > 1) {
+		device_shard_merge(dev, &a);
 	}
 
-	return 0;
+	if (!a.count) {
+		PROBE3(avg_calc_exit, 0, 0, 0);
+		return 0;
+	}
+
+	/* Keep the previous averages to estimate how fast they move. */
+	dev->param_prev = dev->param_avg;
+	dev->param_prev_set = dev->param_avg_set;
+
+	dev->param_avg.temp  = a.temp_sum / a.count;
+	dev->param_avg.brgth = a.brgth_sum / a.count;
+	dev->param_avg_set = 1;
+	dev->param_min = a.min;
+	dev->param_max = a.max;
+	PROBE3(avg_calc_exit, a.count, dev->param_avg.temp,
+			dev->param_avg.brgth);
+
+	device_net_msg_set(dev);
+	warnx("CALC");
+	device_display(dev, 0);
+	return 1;
 }
 
-static int peer_get_resp_recv(Peer *p)
+/* Publish a fresh reading, the state and the message of a master. */
+static void device_shm_publish(Device *dev)
 {
-	Device *dev = p->dev;
-	unsigned char *q = p->buf;
-	size_t n = p->off;
+	ShmData d;
 
-	struct {
-		uint16_t val;
-		int	 upd;
-	} params[PARAM_MAX];
+	memset(&d, 0, sizeof(d));
+	d.stamp = clock_msec();
+	d.cycle = dev->shm_cycle;
+	d.state = dev->state;
 
-	if (*q != MSG_RES) {
-		return -1;
+	if (!device_iscontroller(dev)) {
+		device_reading_gen(dev, &d.temp, &d.brgth);
+		d.flags |= SHM_F_READING;
 	}
 
-	q += 1;
-	/* Partial read. */
-	if (n < 3) {
-		return 1;
+	if ((dev->state == DEV_STATE_MASTER ||
+	     dev->state == DEV_STATE_CONTROLLER) && dev->net_msg_len) {
+		d.msg_epoch = dev->msg_epoch;
+		d.msg_brgth = dev->param_avg.brgth;
+		d.msg_len = dev->net_msg_len - 1;
+		memcpy(d.msg, dev->net_msg, d.msg_len);
 	}
+	d.poll_from = dev->shm_from;
+	d.poll_to = dev->shm_to;
 
-	uint16_t len = get_u16(q);
-	if (len != 9) {
-		return -1;
-	}
-	q += 2;
+	shm_slot_write(&dev->shm->slots[dev->host], &d);
+}
 
-	/* Partial read. */
-	if (len > n) {
-		return 1;
-	}
+/* A live controller or a master with a higher address which has read the
+ * table since the last check polls the device like a GET does. */
+static void device_shm_check(Device *dev)
+{
+	int64_t now = clock_msec();
+	int i, polled = 0;
+	ShmData d;
+
+	for (i = 0; i < SHM_SLOTS; i++) {
+		if (i == dev->host ||
+		    !shm_slot_read(&dev->shm->slots[i], &d) ||
+		    now - d.stamp > DEVICE_SHM_TTL) {
+			continue;
+		}
+		if (d.state != DEV_STATE_CONTROLLER &&
+		    (d.state != DEV_STATE_MASTER || i < dev->host)) {
+			continue;
+		}
+		/* A sharded controller polls only its slice. */
+		if (dev->host < d.poll_from || dev->host > d.poll_to) {
+			continue;
+		}
+		if (d.cycle == dev->shm_cycle_rx[i]) {
+			continue;
+		}
 
-	assert(len == n);
-	unsigned char *e = q + len - 3;
+		dev->shm_cycle_rx[i] = d.cycle;
+		polled = 1;
 
-	memset(&params, 0, sizeof(params));
-	while (q < e) {
-		unsigned char type = *q++;
-		switch (type) {
-		case PARAM_TEMP:
-		case PARAM_BRGHT:
-			if (params[type].upd) {
-				return -1;
-			}
-			params[type].upd = 1;
-			params[type].val = get_u16(q);
-			q += 2;
-			break;
-		default:
-			return -1;
+		if (d.msg_len && (i != dev->shm_shown_from ||
+				d.msg_epoch != dev->shm_shown_epoch)) {
+			dev->shm_shown_from = i;
+			dev->shm_shown_epoch = d.msg_epoch;
+			d.msg[d.msg_len < SHM_MSG_SIZE ?
+				d.msg_len : SHM_MSG_SIZE - 1] = 0;
+			device_msg_show(dev, d.msg_brgth, d.msg);
 		}
 	}
 
-	if (!params[PARAM_TEMP].upd || !params[PARAM_BRGHT].upd) {
-		return -1;
+	if (polled) {
+		device_polled(dev);
 	}
-
-	device_params_put(dev, params[PARAM_TEMP].val, params[PARAM_BRGHT].val);
-	device_drop_peer(dev, p);
-
-	return 0;
 }
 
-static int peer_rd_after_wr(Peer *p)
+static void device_shm_tick(LoopTimer *t, void *opaque)
 {
-	p->off = 0;
-	loop_fd_change(p->fd, LOOP_RD);
-	return 0;
+	Device *dev = opaque;
+
+	device_shm_publish(dev);
+	if (!device_iscontroller(dev)) {
+		device_shm_check(dev);
+	}
+	loop_timer_set(t, DEVICE_SHM_TICK);
 }
 
-static void
-device_connect_range(Device *dev, const Range *range, int excl,
-			void (*on_connect)(int fd, LoopEvent e, void *opaque))
+/* Take readings of co-located nodes from the table, they are skipped by
+ * socket dispatch in this cycle. */
+static void device_shm_poll(Device *dev, const Range *range, int excl)
 {
+	int64_t now = clock_msec();
+	ShmData d;
 	int i;
 
+	memset(dev->shm_read, 0, sizeof(dev->shm_read));
+	if (dev->shm == NULL) {
+		return;
+	}
+
 	for (i = range->from; i <= range->to; i++) {
-		if (excl >= 0 && excl == i) {
+		if (i == excl || i == dev->host ||
+		    !shm_slot_read(&dev->shm->slots[i], &d) ||
+		    !(d.flags & SHM_F_READING) ||
+		    now - d.stamp > DEVICE_SHM_TTL) {
 			continue;
 		}
-		char sock[32];
-		snprintf(sock, sizeof(sock), "%d", i);
+		dev->shm_read[i] = 1;
+		device_reading_put(dev, i, d.temp, d.brgth);
+	}
 
-		int fd = unix_connect(sock, 1);
-		if (fd < 0) {
-			continue;
-		}
+	/* Tell the read nodes about the new cycle and the message. */
+	dev->shm_from = range->from;
+	dev->shm_to = range->to;
+	dev->shm_cycle++;
+	device_shm_publish(dev);
+}
 
-		/* Set vtable when connection is established. */
-		Peer *p = peer_alloc(fd, dev);
-		if (p == NULL) {
-			close(fd);
-			continue;
-		}
+static void device_poll_interval_reset(Device *dev)
+{
+	dev->stats.interval = dev->stats.interval_max;
+	dev->param_avg_set = 0;
+	dev->param_prev_set = 0;
+}
 
-		list_prepend((struct list **)&dev->head, (struct list *)p);
-		loop_fd_add(p->fd, LOOP_WR, on_connect, p);
-	}
+/* Averages move fast when either of them moved by more than half of the
+ * spread of the cycle readings, smaller moves are noise of the sensors. */
+static int device_poll_fast(const Device *dev)
+{
+	int dt = abs(dev->param_avg.temp - dev->param_prev.temp);
+	int db = abs(dev->param_avg.brgth - dev->param_prev.brgth);
+
+	return 2 * dt > dev->param_max.temp - dev->param_min.temp ||
+	       2 * db > dev->param_max.brgth - dev->param_min.brgth;
 }
 
-static void
-peer_master_or_slave_on_connect(int fd, LoopEvent event, void *opaque)
+/* Poll faster when averages move quickly, back off when they are stable or
+ * when the cycles run long, the cycle never gets less than twice its cost. */
+static void device_poll_interval_adapt(Device *dev, int calc, int overrun)
 {
-	Peer *p = opaque;
-	Device *dev = p->dev;
+	DeviceStats *st = &dev->stats;
+	int iv = st->interval;
 
-	assert(dev->state == DEV_STATE_UNKNOWN);
-	UNUSED(event);
+	/* The interval is fixed. */
+	if (st->interval_min == st->interval_max) {
+		return;
+	}
 
-	static const PeerVtable vtable = {
-		peer_hello_resp_recv,	/* on_in */
-		peer_rd_after_wr,	/* on_out */
-		peer_on_poll_hello_drop,
-	};
+	if (overrun || 2 * st->cycle_cost > iv) {
+		iv *= 2;
+	} else if (calc && dev->param_prev_set) {
+		iv = device_poll_fast(dev) ? iv / 2 : iv + iv / 4;
+	}
 
-	/* If connection was success send hello request. */
-	if (peer_check_connection(p)) {
-		loop_fd_del(fd);
-		peer_vtable_set(p, &vtable);
-		peer_hello_req_send(p);
-		loop_fd_add(p->fd, LOOP_WR, peer_rdwr_event, p);
-	} else {
-		device_drop_peer(dev, p);
-		device_master_resolve(dev);
+	if (iv < 2 * st->cycle_cost) {
+		iv = 2 * st->cycle_cost;
+	}
+	iv = iv < st->interval_min ? st->interval_min : iv;
+	iv = iv > st->interval_max ? st->interval_max : iv;
+
+	if (iv != st->interval) {
+		warnx("POLL INTERVAL %d -> %d ms (cost %d ms)",
+				st->interval, iv, st->cycle_cost);
+		st->interval = iv;
 	}
 }
 
-static void device_master_or_slave(Device *dev)
+/* Averages of the cycle are calculated once, when the last peer is done
+ * or at the start of the next cycle if peers are still in flight. */
+static int device_cycle_calc(Device *dev)
 {
-	/* Connect to addresses that are greater to detect the device role. */
-	const Range range = {
-		dev->host + 1, DEVICE_HOST_ADDR_MAX
-	};
+	if (dev->calc_pending) {
+		dev->calc_pending = 0;
+		dev->calc_last = device_param_avg_calc(dev);
+	}
+	return dev->calc_last;
+}
 
-	device_connect_range(dev, &range, -1, peer_master_or_slave_on_connect);
-	device_master_resolve(dev);
+static void device_poll_cycle_done(Device *dev)
+{
+	dev->stats.cycle_cost = clock_msec() - dev->cycle_start;
+	PROBE2(cycle_done, dev->stats.cycles, dev->stats.cycle_cost);
+
+	/* Nothing is in flight, publish the averages now instead of waiting
+	 * for the next polling. */
+	if (dev->calc_pending && device_cycle_calc(dev)) {
+		if (dev->status != NULL) {
+			device_status_publish(dev);
+		}
+		if (dev->snap != NULL) {
+			device_snapshot_save(dev);
+		}
+	}
 }
 
-static void peer_poll_on_connect(int fd, LoopEvent event, void *opaque)
+static void device_poll_sensors(Device *dev)
 {
-	Peer *p = opaque;
-	Device *dev = p->dev;
+	int overrun = 0;
 
-	UNUSED(event);
+	/* If polling is in progress it means the previous poll is not finished
+	 * due to slow or unreacheable peers. Drop unfinished peers or let them
+	 * finish within their deadlines. */
+	if (device_is_polling_inprogress(dev)) {
+		if (!dev->carry) {
+			device_drop_peers(dev);
+			device_poll_cycle_done(dev);
+		}
+		dev->stats.overruns++;
+		overrun = 1;
+	}
 
-	static const PeerVtable vtable = {
-		peer_get_resp_recv,	/* on_in */
-		peer_rd_after_wr,	/* on_out */
-		peer_on_poll_drop,
+	/* Calculate averages from the previous cycle unless it is done. */
+	int calc = device_cycle_calc(dev);
+	if (dev->stats.cycles) {
+		device_poll_interval_adapt(dev, calc, overrun);
+	}
+
+	/* The controller polls all hosts exluding itself, controllers which
+	 * discover each other poll own slices of the range.
+	 * The master polls hosts which addresses are less. */
+	Range range = {
+		0, device_iscontroller(dev) ?
+			DEVICE_HOST_ADDR_MAX : dev->host - 1
 	};
+	const int excl = device_iscontroller(dev) ? dev->host : -1;
 
-	if (peer_check_connection(p)) {
-		loop_fd_del(fd);
-		peer_vtable_set(p, &vtable);
-		dev->net_msg_len ?
-			peer_get_req_send(p, dev->net_msg, dev->net_msg_len,
-						dev->param_avg.brgth) :
-			peer_get_req_empty_send(p);
-		loop_fd_add(p->fd, LOOP_WR, peer_rdwr_event, p);
-	} else {
-		device_drop_peer(dev, p);
+	if (device_iscontroller(dev) && dev->disc_fd != -1) {
+		device_shard(dev, &range);
+	}
+
+	/* Known members are polled, every DEVICE_SWEEP_CYCLES cycle the whole
+	 * range is swept to find nodes which don't announce themselves. */
+	dev->fanout.members = dev->disc_fd != -1 &&
+				dev->stats.cycles % DEVICE_SWEEP_CYCLES;
+	/* Only the first cycle after a warm restart is limited to the
+	 * members restored from the snapshot. */
+	if (dev->stats.cycles) {
+		dev->fanout.restored = 0;
+	}
+	dev->stats.cycles++;
+	dev->cycle_start = clock_msec();
+	dev->calc_pending = 1;
+	dev->calc_last = 0;
+	PROBE2(cycle_start, dev->stats.cycles, dev->stats.interval);
+	device_subs_refresh(dev, &range, excl);
+	device_shm_poll(dev, &range, excl);
+	device_connect_range(dev, &range, excl,
+			dev->stagger ? dev->stats.interval : 0,
+			peer_poll_on_connect);
+	if (!device_is_polling_inprogress(dev)) {
+		device_poll_cycle_done(dev);
 	}
+	/* Schedule a new polling. */
+	dev->ops->timer(dev, dev->stats.interval);
 }
 
-static void device_net_msg_set(Device *dev)
+/* Masters publish the sent message, other nodes the shown one. */
+static void device_status_publish(Device *dev)
 {
-	char date[128];
-	struct tm *tm;
-	time_t t;
-
-	time(&t);
-	tm = localtime(&t);
+	StatusData d;
+	int sender = dev->state == DEV_STATE_MASTER ||
+		     dev->state == DEV_STATE_CONTROLLER;
+
+	memset(&d, 0, sizeof(d));
+	d.stamp = clock_msec();
+	d.pid = dev->pid;
+	d.host = dev->host;
+	d.avg_set = dev->param_avg_set;
+	d.avg_temp = dev->param_avg.temp;
+	d.avg_brgth = dev->param_avg.brgth;
+	d.msg_epoch = sender ? dev->msg_epoch : dev->msg_epoch_rx;
+	d.cycles = dev->stats.cycles;
+	d.overruns = dev->stats.overruns;
+	d.congestions = dev->stats.congestions;
+	d.msg_suppressed = dev->stats.msg_suppressed;
+	d.interval = dev->stats.interval;
+	d.window = dev->stats.window;
+	d.cycle_cost = dev->stats.cycle_cost;
+	d.latency = dev->stats.latency;
+	snprintf(d.state, sizeof(d.state), "%s", device_state2name(dev));
+	snprintf(d.transport, sizeof(d.transport), "%s", dev->tr->name);
+
+	if (sender && dev->net_msg_len) {
+		d.msg_brgth = dev->param_avg.brgth;
+		d.msg_len = dev->net_msg_len - 1;
+		memcpy(d.msg, dev->net_msg, d.msg_len);
+	} else if (!sender) {
+		d.msg_brgth = dev->shown_brgth;
+		d.msg_len = snprintf(d.msg, sizeof(d.msg), "%s",
+					dev->shown_msg);
+	}
 
-	strftime(date, sizeof(date), "%a %b %d %R", tm);
-	dev->net_msg_len = 1 + snprintf(dev->net_msg, sizeof(dev->net_msg),
-					"%u'C, %s", dev->param_avg.temp, date);
+	status_slot_write(&dev->status->slots[dev->host], &d);
 }
 
-static void device_param_avg_calc(Device *dev)
+/* The snapshot is rewritten on every step, it is a copy into the mapped
+ * file without system calls. Members are the sensors replied within the
+ * last sweep. */
+static void device_snapshot_save(Device *dev)
 {
-	if (!dev->params_used) {
-		return;
-	}
-
-	uint64_t t = 0, b = 0;
-	size_t i;
+	SnapData d;
+	int sender = dev->state == DEV_STATE_MASTER ||
+		     dev->state == DEV_STATE_CONTROLLER;
+	int i;
 
-	for (i = 0; i < dev->params_used; i++) {
-		t += dev->params[i].temp;
-		b += dev->params[i].brgth;
+	memset(&d, 0, sizeof(d));
+	d.stamp = clock_wall_msec();
+	d.host = dev->host;
+	d.state = dev->state;
+	d.interval = dev->stats.interval;
+	d.avg_set = dev->param_avg_set;
+	d.avg_temp = dev->param_avg.temp;
+	d.avg_brgth = dev->param_avg.brgth;
+	d.msg_epoch = sender ? dev->msg_epoch : dev->msg_epoch_rx;
+
+	if (sender && dev->net_msg_len) {
+		d.msg_brgth = dev->param_avg.brgth;
+		d.msg_len = dev->net_msg_len - 1;
+		memcpy(d.msg, dev->net_msg, d.msg_len);
+	} else if (!sender) {
+		d.msg_brgth = dev->shown_brgth;
+		d.msg_len = strnlen(dev->shown_msg, sizeof(d.msg) - 1);
+		memcpy(d.msg, dev->shown_msg, d.msg_len);
 	}
 
-	dev->param_avg.temp  = t / dev->params_used;
-	dev->param_avg.brgth = b / dev->params_used;
-	dev->params_used = 0;
+	/* Until the first cycle completes readings are empty, the restored
+	 * members are kept for the next restart. */
+	if (dev->fanout.restored) {
+		memcpy(d.members, dev->snap_members, sizeof(d.members));
+	}
+	for (i = 0; i <= DEVICE_HOST_ADDR_MAX; i++) {
+		uint32_t seen = dev->readings.seen[i];
+		if (seen && dev->stats.cycles - seen < DEVICE_SWEEP_CYCLES) {
+			d.members[i / 64] |= (uint64_t)1 << (i % 64);
+		}
+	}
 
-	device_net_msg_set(dev);
-	warnx("CALC");
-	dev->ops->display(dev, DEF_FMT " brigtness (avg): %u, temp (avg): %u'C",
-			device_state2name(dev) , dev->host,
-			dev->param_avg.brgth, dev->param_avg.temp);
+	snapshot_write(dev->snap, &d);
 }
 
-static void device_poll_sensors(Device *dev)
+/* A node restarted within DEVICE_SNAPSHOT_TTL resumes its role. A master
+ * keeps its averages, message and epoch, so the first requests carry the
+ * message, and polls the restored members first. A slave keeps showing its
+ * message and waits for the master instead of the election. */
+static void device_snapshot_restore(Device *dev)
 {
-	/* If polling is in progress it means the previous poll is not finished
-	 * due to slow or unreacheable peers. Drop unfinished peers. */
-	if (device_is_polling_inprogress(dev)) {
-		device_drop_peers(dev);
+	SnapData d;
+	int64_t age;
+
+	if (!snapshot_read(dev->snap, &d) || d.host != dev->host ||
+	    d.msg_len >= sizeof(d.msg)) {
+		return;
 	}
 
-	/* Calculate averages from the previous cycle. */
-	device_param_avg_calc(dev);
+	age = clock_wall_msec() - d.stamp;
+	if (age < 0 || age > DEVICE_SNAPSHOT_TTL) {
+		warnx("SNAPSHOT STALE %lld ms", (long long)age);
+		return;
+	}
 
-	/* The controller polls all hosts exluding itself.
-	 * The master polls hosts which addresses are less. */
-	const Range range = {
-		0, device_iscontroller(dev) ?
-			DEVICE_HOST_ADDR_MAX : dev->host - 1
-	};
-	const int excl = device_iscontroller(dev) ? dev->host : -1;
+	/* The controller role is configured, not resumed. */
+	if ((d.state == DEV_STATE_CONTROLLER) != device_iscontroller(dev)) {
+		return;
+	}
 
-	device_connect_range(dev, &range, excl, peer_poll_on_connect);
-	/* Schedule a new polling. */
-	dev->ops->timer(dev, DEVICE_MASTER_TIMEOUT);
+	switch (d.state) {
+	case DEV_STATE_CONTROLLER:
+	case DEV_STATE_MASTER:
+		if (d.avg_set) {
+			dev->param_avg.temp = d.avg_temp;
+			dev->param_avg.brgth = d.avg_brgth;
+			dev->param_avg_set = 1;
+		}
+		if (d.msg_len) {
+			memcpy(dev->net_msg, d.msg, d.msg_len);
+			dev->net_msg[d.msg_len] = 0;
+			dev->net_msg_len = d.msg_len + 1;
+		}
+		if (d.msg_epoch) {
+			dev->msg_epoch = d.msg_epoch;
+		}
+		if (d.interval >= dev->stats.interval_min &&
+		    d.interval <= dev->stats.interval_max) {
+			dev->stats.interval = d.interval;
+		}
+		memcpy(dev->snap_members, d.members, sizeof(d.members));
+		dev->fanout.restored = 1;
+		break;
+	case DEV_STATE_SLAVE:
+		memcpy(dev->shown_msg, d.msg, d.msg_len);
+		dev->shown_msg[d.msg_len] = 0;
+		dev->shown_brgth = d.msg_brgth;
+		dev->msg_epoch_rx = d.msg_epoch;
+		break;
+	default:
+		return;
+	}
+
+	device_state_set(dev, d.state);
+	warnx("SNAPSHOT %s age %lld ms", device_state2name(dev),
+			(long long)age);
+	device_display(dev, 1);
 }
 
 static void device_next_step(Device *dev)
 {
+	if (dev->disc_fd != -1 && dev->disc_state != dev->state) {
+		device_announce(dev, 0);
+	}
+
 	switch (dev->state) {
 	case DEV_STATE_UNKNOWN:
+		dev->shown_msg[0] = 0;
+		/* Epochs are never 0, an UNCHANGED GET is STALE now. */
+		dev->msg_epoch_rx = 0;
 		dev->ops->timer(dev, 0);
+		device_idle_close(dev);
+		device_subs_close(dev);
+		/* The master is gone, stop pushing to it. */
+		if (dev->up.p != NULL) {
+			device_upstream_close(dev);
+		}
 		device_master_or_slave(dev);
 		break;
 	case DEV_STATE_SLAVE:
-		dev->params_used = 0;
+		memset(&dev->readings, 0, sizeof(dev->readings));
 		dev->net_msg_len = 0;
+		device_poll_interval_reset(dev);
+		/* Nodes might be upgraded while the device is a slave. */
+		memset(dev->proto, 0, sizeof(dev->proto));
+		device_idle_close(dev);
+		device_subs_close(dev);
+		device_msg_epoch_reset(dev);
 		dev->ops->timer(dev, DEVICE_SLAVE_TIMEOUT);
 		break;
 	case DEV_STATE_CONTROLLER:
@@ -818,6 +2664,13 @@ static void device_next_step(Device *dev)
 	default:
 		abort();
 	}
+
+	if (dev->status != NULL) {
+		device_status_publish(dev);
+	}
+	if (dev->snap != NULL) {
+		device_snapshot_save(dev);
+	}
 }
 
 void device_timeout(Device *dev)
@@ -825,53 +2678,174 @@ void device_timeout(Device *dev)
 	switch (dev->state) {
 	case DEV_STATE_SLAVE:
 		/* There are no requests for a long time. */
-		dev->state = DEV_STATE_UNKNOWN;
-		dev->ops->display(dev, DEF_FMT,
-					device_state2name(dev), dev->host);
-		device_next_step(dev);
+		device_state_set(dev, DEV_STATE_UNKNOWN);
+		device_display(dev, 1);
+		device_step_defer(dev);
 		break;
 	case DEV_STATE_CONTROLLER:
 	case DEV_STATE_MASTER:
 		/* Rerun sensors polling. */
-		device_next_step(dev);
+		device_step_defer(dev);
 		break;
 	default:
 		abort();
 	}
 }
 
-int device_init(Device *dev, int host, int iscontroller, const DeviceOps *ops)
+void device_conf_default(DeviceConf *conf)
 {
+	memset(conf, 0, sizeof(*conf));
+	conf->transport = transport_find(NULL);
+	conf->fanout_max = DEVICE_FANOUT_MAX;
+	conf->proto_max = PROTO_VERSION;
+	conf->batch = 1;
+	conf->poll_min = DEVICE_MASTER_TIMEOUT;
+	conf->poll_max = DEVICE_MASTER_TIMEOUT;
+	conf->display_tick = DEVICE_DISPLAY_TICK;
+	conf->peer_timeout = DEVICE_PEER_TIMEOUT;
+	conf->sub_deadband = -1;
+	conf->sub_heartbeat = DEVICE_SUB_HEARTBEAT;
+}
+
+int device_init(Device *dev, const DeviceConf *conf, const DeviceOps *ops)
+{
+	int host = conf->host;
+	int iscontroller = conf->iscontroller;
+
 	memset(dev, 0, sizeof(*dev));
 	dev->state = iscontroller ? DEV_STATE_CONTROLLER : DEV_STATE_UNKNOWN;
 	dev->host = host;
 	dev->fd = -1;
 	dev->ops = ops;
+	dev->tr = conf->transport;
+	memset(dev->idle, -1, sizeof(dev->idle));
+	dev->stagger = conf->stagger;
+	dev->proto_max = conf->proto_max;
+	dev->batch = conf->batch;
+	dev->fanout.next = 0;
+	dev->fanout.to = -1;
+	dev->fanout.excl = -1;
+	dev->fanout.window_max = conf->fanout_max;
+	dev->fanout.window = DEVICE_FANOUT_INIT < conf->fanout_max ?
+				DEVICE_FANOUT_INIT : conf->fanout_max;
+	dev->stats.window = dev->fanout.window;
+	device_msg_epoch_reset(dev);
+	loop_timer_init(&dev->fanout.timer, device_dispatch_tick, dev);
+	dev->stats.interval_min = conf->poll_min;
+	dev->stats.interval_max = conf->poll_max;
+	dev->stats.interval = conf->poll_max;
+	dev->disc_fd = -1;
+	dev->disc_state = -1;
+	loop_timer_init(&dev->disc_timer, device_announce_tick, dev);
+	loop_timer_init(&dev->elect_timer, device_elect_tick, dev);
+	loop_timer_init(&dev->shm_timer, device_shm_tick, dev);
+	loop_timer_init(&dev->display_timer, device_display_tick, dev);
+	loop_task_init(&dev->step_task, device_step_task, dev);
+	loop_timer_init(&dev->cap_timer, device_capture_tick, dev);
+	loop_timer_init(&dev->up.timer, device_upstream_tick, dev);
+	loop_timer_init(&dev->sample_timer, device_sample_tick, dev);
+	dev->sub_deadband = conf->sub_deadband;
+	dev->sub_heartbeat = conf->sub_heartbeat;
+	dev->display_tick = conf->display_tick;
+	dev->peer_timeout = conf->peer_timeout;
+	dev->carry = conf->carry;
+	dev->shm_shown_from = -1;
+	dev->shm_to = -1;
+
+	dev->peers = malloc((DEVICE_HOST_ADDR_MAX + 1) * sizeof(*dev->peers));
+	if (dev->peers == NULL) {
+		warn("malloc()");
+		return -1;
+	}
 
-	if (!iscontroller) {
-		char sock[32];
-		snprintf(sock, sizeof(sock), "%d", host);
+	if (conf->capture) {
+		dev->cap = capture_open(conf->capture, host);
+		if (dev->cap == NULL) {
+			warn("capture_open(%s)", conf->capture);
+			return -1;
+		}
+		loop_timer_set(&dev->cap_timer, DEVICE_CAPTURE_FLUSH);
+	}
+
+	const char *spec = conf->source ? conf->source : SOURCE_DEFAULT;
+	dev->src = source_open(spec, host);
+	if (dev->src == NULL) {
+		warn("source_open(%s)", spec);
+		return -1;
+	}
+
+	if (conf->status) {
+		dev->status = status_map(conf->status);
+		if (dev->status == NULL) {
+			warn("status_map(%s)", conf->status);
+			return -1;
+		}
+		dev->pid = getpid();
+	}
+
+	if (conf->shm) {
+		dev->shm = shm_table_map(conf->shm);
+		if (dev->shm == NULL) {
+			warn("shm_table_map(%s)", conf->shm);
+			return -1;
+		}
+		loop_timer_set(&dev->shm_timer, DEVICE_SHM_TICK);
+	}
+
+	if (conf->discovery) {
+		int fd = discovery_open(conf->discovery);
+		if (fd < 0) {
+			warn("discovery_open(%s)", conf->discovery);
+			return -1;
+		}
+		dev->disc_fd = fd;
+		loop_fd_add(fd, LOOP_RD, device_discovery_event, dev);
+		loop_timer_set(&dev->disc_timer, DEVICE_ANNOUNCE_PERIOD);
+	}
 
-		int rc = unlink(sock);
-		if (rc < 0 && errno != ENOENT) {
-			warn("unlink()");
+	if (conf->watch) {
+		if (strcmp(dev->tr->name, "unix")) {
+			warnx("WATCH needs the unix transport");
+			return -1;
+		}
+		dev->watch = dirwatch_open(".");
+		if (dev->watch == NULL) {
+			warn("dirwatch_open()");
 			return -1;
 		}
+		loop_fd_add(dirwatch_fd(dev->watch), LOOP_RD,
+				device_watch_event, dev);
+	}
 
-		int fd = unix_listen(sock);
+	if (!iscontroller) {
+		int fd = dev->tr->listen(host);
 		if (fd < 0) {
-			warn("unix_listen()");
+			warn("%s listen()", dev->tr->name);
 			return -1;
 		}
 
 		if (fd_nonblock(fd) < 0) {
 			warn("fd_nonblock()");
-			close(fd);
+			loop_fd_close(fd);
 			return -1;
 		}
 
 		dev->fd = fd;
 		loop_fd_add(fd, LOOP_RD, device_srv_event, dev);
+
+		dev->sample = conf->sample;
+		if (dev->sample) {
+			loop_timer_set(&dev->sample_timer, dev->sample);
+		}
+	}
+
+	if (conf->snapshot) {
+		dev->snap = snapshot_map(conf->snapshot, host);
+		if (dev->snap == NULL) {
+			warn("snapshot_map(%s)", conf->snapshot);
+			return -1;
+		}
+		device_snapshot_restore(dev);
 	}
 
 	return 0;
@@ -886,14 +2860,56 @@ void device_run(Device *dev)
 void device_deinit(Device *dev)
 {
 	if (dev->fd != -1) {
-		loop_fd_del(dev->fd);
-		close(dev->fd);
-		char sock[32];
-		snprintf(sock, sizeof(sock), "%d", dev->host);
-		unlink(sock);
+		loop_fd_close(dev->fd);
+		dev->tr->unlisten(dev->host);
 	}
 
 	device_drop_peers(dev);
-	free(dev->params);
+	device_idle_close(dev);
+	device_subs_close(dev);
+	if (dev->up.p != NULL) {
+		device_upstream_close(dev);
+	}
+	loop_timer_cancel(&dev->display_timer);
+	loop_timer_cancel(&dev->sample_timer);
+	loop_task_cancel(&dev->step_task);
+
+	if (dev->disc_fd != -1) {
+		/* Let others forget the node without waiting for TTL. */
+		device_announce(dev, DISC_F_LEAVE);
+		loop_timer_cancel(&dev->disc_timer);
+		loop_timer_cancel(&dev->elect_timer);
+		loop_fd_close(dev->disc_fd);
+	}
+	if (dev->shm != NULL) {
+		/* An empty slot is never read. */
+		ShmData d;
+		memset(&d, 0, sizeof(d));
+		shm_slot_write(&dev->shm->slots[dev->host], &d);
+		loop_timer_cancel(&dev->shm_timer);
+		shm_table_unmap(dev->shm);
+	}
+	if (dev->status != NULL) {
+		StatusData d;
+		memset(&d, 0, sizeof(d));
+		status_slot_write(&dev->status->slots[dev->host], &d);
+		status_unmap(dev->status);
+	}
+	/* The snapshot is kept for the next start. */
+	if (dev->snap != NULL) {
+		snapshot_unmap(dev->snap);
+	}
+	if (dev->src != NULL) {
+		source_close(dev->src);
+	}
+	if (dev->watch != NULL) {
+		dirwatch_close(dev->watch);
+	}
+	/* Peers are closed, the capture gets all close records. */
+	if (dev->cap != NULL) {
+		loop_timer_cancel(&dev->cap_timer);
+		capture_close(dev->cap);
+	}
+	free(dev->peers);
 }
 
@@ -3,16 +3,74 @@
 
 #include <stdint.h>
 
-/* Timeout to polling sensors in msec. */
+#include "loop.h"
+#include "transport.h"
+#include "discovery.h"
+#include "shm.h"
+#include "status.h"
+#include "snapshot.h"
+#include "source.h"
+#include "capture.h"
+#include "dirwatch.h"
+#include "sampler.h"
+
+/* Timeout to polling sensors in msec, it is the polling interval unless
+ * POLL_ADAPT sets bounds, and the ceiling of the adaptive interval. */
 #define	DEVICE_MASTER_TIMEOUT	2000
+/* The lowest floor of the adaptive polling interval in msec. */
+#define DEVICE_POLL_MIN		250
 /* Timeout for waiting a request from a controller. */
 #define DEVICE_SLAVE_TIMEOUT	(3 * DEVICE_MASTER_TIMEOUT)
-#define DEVICE_HOST_ADDR_MAX	255
+#define DEVICE_HOST_ADDR_MAX	TRANSPORT_ADDR_MAX
+/* Bounds and the initial value of the polled peers in flight window. */
+#define DEVICE_FANOUT_MIN	4
+#define DEVICE_FANOUT_MAX	(DEVICE_HOST_ADDR_MAX + 1)
+#define DEVICE_FANOUT_INIT	32
+/* Peer round trip in msec which is treated as congestion. */
+#define DEVICE_FANOUT_LATENCY	100
+/* The shortest gap between staggered dispatches in msec. */
+#define DEVICE_STAGGER_TICK	2
+/* Discovery announce period, members expire after 3 missed announces. */
+#define DEVICE_ANNOUNCE_PERIOD	1000
+#define DEVICE_MEMBER_TTL	(3 * DEVICE_ANNOUNCE_PERIOD)
+/* Time to collect announces before an election is resolved. */
+#define DEVICE_DISCOVERY_WAIT	100
+/* Every such cycle polls the whole range to find silent nodes. */
+#define DEVICE_SWEEP_CYCLES	8
+/* Controllers send partial aggregates every cycle, older ones are stale. */
+#define DEVICE_SHARD_TTL	(DEVICE_MASTER_TIMEOUT + DEVICE_MASTER_TIMEOUT / 2)
+/* Shared table publish and check period, slots expire after the TTL. */
+#define DEVICE_SHM_TICK		100
+#define DEVICE_SHM_TTL		(10 * DEVICE_SHM_TICK)
+/* Display updates are coalesced and rendered once per tick in msec. */
+#define DEVICE_DISPLAY_TICK	100
+/* A polled peer which makes no progress for so long is dropped, msec. */
+#define DEVICE_PEER_TIMEOUT	1000
+/* A snapshot older than this is not resumed, others have moved on. */
+#define DEVICE_SNAPSHOT_TTL	DEVICE_SLAVE_TIMEOUT
+/* The longest source sampling period in msec, a sensor might be polled so
+ * often. */
+#define DEVICE_SAMPLE_MAX	DEVICE_POLL_MIN
+/* Captured records are written out at least so often, msec. */
+#define DEVICE_CAPTURE_FLUSH	1000
+/* A subscribed sensor samples its source so often and pushes at least once
+ * per heartbeat, the master keeps it a slave with the same period. */
+#define DEVICE_SUB_SAMPLE	100
+#define DEVICE_SUB_HEARTBEAT	2000
+#define DEVICE_SUB_HEARTBEAT_MAX (DEVICE_SLAVE_TIMEOUT / 2)
+/* A sensor which refused the subscription is polled for so many cycles
+ * before the next try. */
+#define DEVICE_SUB_RETRY	30
 
 typedef struct Peer Peer;
 typedef struct Param Param;
 typedef struct Device Device;
 typedef struct DeviceOps DeviceOps;
+typedef struct DeviceStats DeviceStats;
+typedef struct DeviceConf DeviceConf;
+typedef struct DeviceFanout DeviceFanout;
+typedef struct DeviceReadings DeviceReadings;
+typedef struct DeviceUpstream DeviceUpstream;
 
 struct Param {
 	uint16_t	temp;
@@ -25,22 +83,185 @@ struct DeviceOps {
 	void	(*timer)(const Device *dev, int msec);
 };
 
+struct DeviceStats {
+	unsigned	cycles;		/* started polling cycles */
+	unsigned	overruns;	/* cycles cut by the next polling */
+	int		interval;	/* current polling interval in msec */
+	int		interval_min;	/* floor of the polling interval */
+	int		interval_max;	/* ceiling of the polling interval */
+	int		cycle_cost;	/* duration of the last cycle in msec */
+	int		window;		/* polled peers in flight limit */
+	unsigned	congestions;	/* window decreases */
+	int		latency;	/* peer round trip of the last reply */
+	unsigned	msg_suppressed;	/* GETs sent without unchanged text */
+	unsigned	display_skipped; /* renders equal to the shown text */
+	unsigned	steps_coalesced; /* re-plans merged into a pending one */
+	unsigned	timeouts;	/* peers retired by their deadlines */
+	unsigned	late;		/* replies carried from previous cycles */
+	unsigned	inflight_dups;	/* polls of addresses still in flight */
+	unsigned	pushes;		/* readings pushed by subscribed sensors */
+	unsigned	samples;	/* samples summarized in replies */
+	unsigned	responded;	/* sensors replied in the last cycle */
+	unsigned	missing;	/* known sensors silent in the last cycle */
+};
+
+struct DeviceConf {
+	int	host;
+	int	iscontroller;
+	const Transport *transport;
+	int	fanout_max;	/* ceiling of the in flight window */
+	int	stagger;	/* spread dispatch across the polling interval */
+	int	proto_max;	/* the highest supported protocol version */
+	int	batch;		/* readings requested in a single v2 RES */
+	int	poll_min;	/* bounds of the adaptive polling interval */
+	int	poll_max;
+	const char *discovery;	/* discovery channel spec or NULL */
+	const char *shm;	/* shared sensor table path or NULL */
+	const char *status;	/* status page path or NULL */
+	const char *snapshot;	/* snapshot path prefix or NULL */
+	const char *source;	/* value source spec, NULL - SOURCE_DEFAULT */
+	const char *capture;	/* capture path prefix or NULL */
+	int	display_tick;	/* display coalescing tick, 0 - render at once */
+	int	peer_timeout;	/* polled peer no progress timeout in msec */
+	int	carry;		/* unfinished polls carry over the cycle */
+	int	watch;		/* poll only addresses with socket files */
+	int	sub_deadband;	/* subscribe v2 sensors, -1 - poll only */
+	int	sub_heartbeat;	/* max silence of a subscribed sensor */
+	int	sample;		/* source sampling period in msec, 0 - off */
+};
+
+/* Connections are dispatched from the address range [next, to] while the
+ * number of peers in flight is less than the window. When dispatch is
+ * staggered the timer moves allow forward by step addresses per slot. */
+struct DeviceFanout {
+	int	next;		/* next address to connect */
+	int	to;		/* last address of the range */
+	int	allow;		/* last address allowed to connect now */
+	int	excl;		/* address to skip or -1 */
+	int	members;	/* skip addresses which are not live members */
+	int	restored;	/* poll only members restored from a snapshot */
+	int	step;		/* addresses allowed per staggered slot */
+	int	slot;		/* staggered slot in msec */
+	int	inflight;	/* peers in flight */
+	int	window;		/* max peers in flight */
+	int	window_max;
+	int	acks;		/* replies since the last window increase */
+	int	backoff;	/* window is already decreased in this cycle */
+	LoopEventCb on_connect;
+	LoopTimer timer;	/* staggered dispatch */
+};
+
+#define DEVICE_READINGS_WORDS	((DEVICE_HOST_ADDR_MAX + 64) / 64)
+
+/* The subscription of the master a sensor pushes its readings to. */
+struct DeviceUpstream {
+	Peer		*p;		/* the master connection or NULL */
+	uint32_t	id;		/* SUB request id */
+	int		deadband;
+	int		heartbeat;
+	uint16_t	temp;		/* the last pushed reading */
+	uint16_t	brgth;
+	int64_t		pushed;		/* time of the last push */
+	LoopTimer	timer;		/* source sampling */
+};
+
+/* Readings of a polling cycle indexed by sensor address, a reading counts
+ * while its bit is set in valid. A reading is the mean of a summary or a
+ * single value, the bounds are those of the summary or the value itself. */
+struct DeviceReadings {
+	uint16_t	temp[64 * DEVICE_READINGS_WORDS];
+	uint16_t	brgth[64 * DEVICE_READINGS_WORDS];
+	uint16_t	temp_min[64 * DEVICE_READINGS_WORDS];
+	uint16_t	temp_max[64 * DEVICE_READINGS_WORDS];
+	uint16_t	brgth_min[64 * DEVICE_READINGS_WORDS];
+	uint16_t	brgth_max[64 * DEVICE_READINGS_WORDS];
+	uint32_t	seen[64 * DEVICE_READINGS_WORDS]; /* cycle, 0 - never */
+	uint64_t	valid[DEVICE_READINGS_WORDS];
+};
+
 struct Device {
 	int	state;
 	int	host;		/* host addr */
 	int	fd;		/* srv fd to accept connection */
-	Peer	*head;		/* list of polling devices */
-	Param	*params;	/* immediate params from sensors */
-	size_t	params_used;
-	size_t	params_size;
+	const Transport *tr;
+	Peer	*peers;		/* preallocated polled peer per addr */
+	uint64_t active[DEVICE_READINGS_WORDS]; /* addrs with a polled peer */
+	Peer	*subs[DEVICE_HOST_ADDR_MAX + 1]; /* subscribed sensors */
+	uint64_t subbed[DEVICE_READINGS_WORDS]; /* addrs with a subscription */
+	unsigned sub_retry[DEVICE_HOST_ADDR_MAX + 1]; /* cycle of the next SUB */
+	int	sub_deadband;	/* -1 - sensors are polled only */
+	int	sub_heartbeat;
+	DeviceUpstream up;	/* subscription of the sensor's master */
+	int	sample;		/* source sampling period, 0 - off */
+	Sampler	sampler;	/* samples since the last RES */
+	LoopTimer sample_timer;
+	DeviceReadings readings; /* readings of the current cycle */
 	Param	param_avg;	/* calucated avg params for sending */
+	Param	param_min;	/* bounds of the last calculated cycle */
+	Param	param_max;
 	char	net_msg[64];	/* master message to send to other devices */
 	int	net_msg_len;	/* cached net_msg length */
+	int	param_avg_set;	/* param_avg holds a calculated value */
+	Param	param_prev;	/* previous avg params to track changes */
+	int	param_prev_set;	/* param_prev holds a calculated value */
+	int64_t	cycle_start;	/* start time of the current polling */
+	int	calc_pending;	/* averages of the cycle are not calculated */
+	int	calc_last;	/* the last cycle calculated averages */
+	int	stagger;	/* spread dispatch across the polling interval */
+	int	proto_max;	/* the highest supported protocol version */
+	int	batch;		/* readings requested in a single v2 RES */
+	uint32_t req_id;	/* the last v2 request id */
+	uint8_t	proto[DEVICE_HOST_ADDR_MAX + 1]; /* negotiated, 0 - unknown */
+	uint32_t msg_epoch;	/* epoch of net_msg in this master session */
+	uint32_t msg_epoch_rx;	/* epoch of the shown message */
+	uint32_t msg_acked[DEVICE_HOST_ADDR_MAX + 1]; /* delivered epochs */
+	int	idle[DEVICE_HOST_ADDR_MAX + 1]; /* v2 connections to reuse */
+	int	disc_fd;	/* discovery socket or -1 */
+	int	disc_state;	/* the last announced state */
+	LoopTimer disc_timer;	/* periodic announce */
+	LoopTimer elect_timer;	/* collect announces in UNKNOWN */
+	int64_t	member_seen[DEVICE_HOST_ADDR_MAX + 1]; /* last announce time */
+	uint8_t	member_role[DEVICE_HOST_ADDR_MAX + 1]; /* announced state */
+	int	shard_n;	/* controllers sharing the range, 0 - alone */
+	int	shard_from;	/* the slice polled by the controller */
+	int	shard_to;
+	DiscoveryAggr shard_aggr[DEVICE_HOST_ADDR_MAX + 1]; /* other slices */
+	int64_t	shard_seen[DEVICE_HOST_ADDR_MAX + 1]; /* receive time */
+	ShmTable *shm;		/* shared sensor table or NULL */
+	LoopTimer shm_timer;	/* publish and check the table */
+	uint32_t shm_cycle;	/* polling cycles published in the slot */
+	int	shm_from;	/* the range of the published cycle */
+	int	shm_to;
+	uint32_t shm_cycle_rx[DEVICE_HOST_ADDR_MAX + 1]; /* seen cycles */
+	uint8_t	shm_read[DEVICE_HOST_ADDR_MAX + 1]; /* not polled by sockets */
+	int	shm_shown_from;	/* writer of the shown message or -1 */
+	uint32_t shm_shown_epoch;
+	char	shown_msg[64];	/* the last shown message */
+	uint16_t shown_brgth;	/* brightness of the shown message */
+	StatusPage *status;	/* status page or NULL */
+	Snapshot *snap;		/* warm restart snapshot or NULL */
+	Source	*src;		/* readings reported by the sensor */
+	Capture	*cap;		/* wire capture or NULL */
+	DirWatch *watch;	/* socket files in the directory or NULL */
+	LoopTimer cap_timer;	/* flush of the capture */
+	uint64_t snap_members[DEVICE_READINGS_WORDS]; /* restored members */
+	int	pid;
+	char	display[256];	/* the rendered display text */
+	int	display_dirty;	/* display is to be rendered on the tick */
+	int	display_tick;
+	LoopTimer display_timer;
+	LoopTask step_task;	/* deferred device_next_step() */
+	int	peer_timeout;
+	int	carry;		/* unfinished polls carry over the cycle */
+	DeviceFanout fanout;
+	DeviceStats stats;
 	const DeviceOps *ops;
 };
 
 
-int device_init(Device *dev, int host, int iscontroller, const DeviceOps *ops);
+void device_conf_default(DeviceConf *conf);
+
+int device_init(Device *dev, const DeviceConf *conf, const DeviceOps *ops);
 
 void device_run(Device *dev);
 
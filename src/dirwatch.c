@@ -0,0 +1,259 @@
+#include <sys/types.h>
+#include <sys/stat.h>
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <dirent.h>
+#include <errno.h>
+
+#ifdef HAVE_INOTIFY
+#  include <sys/inotify.h>
+#endif
+
+#include "loop.h"
+#include "utils.h"
+#include "dirwatch.h"
+
+struct DirWatch {
+	int		fd;		/* inotify instance */
+	int		dfd;		/* the watched directory */
+	uint64_t	addrs[DIRWATCH_WORDS];
+};
+
+/* Socket names are decimal addresses without leading zeros. */
+static int dirwatch_addr(const char *name)
+{
+	int addr = 0;
+
+	if (name[0] == '0' && name[1] != 0) {
+		return -1;
+	}
+	do {
+		if (*name < '0' || *name > '9') {
+			return -1;
+		}
+		addr = addr * 10 + *name - '0';
+		if (addr >= DIRWATCH_ADDRS) {
+			return -1;
+		}
+	} while (*++name);
+
+	return addr;
+}
+
+static int dirwatch_set(DirWatch *w, int addr, int on)
+{
+	uint64_t bit = (uint64_t)1 << (addr % 64);
+	uint64_t old = w->addrs[addr / 64];
+
+	if (on) {
+		w->addrs[addr / 64] |= bit;
+	} else {
+		w->addrs[addr / 64] &= ~bit;
+	}
+	return old != w->addrs[addr / 64] ? 1 : 0;
+}
+
+static int dirwatch_is_sock(const DirWatch *w, const char *name)
+{
+	struct stat st;
+
+	return fstatat(w->dfd, name, &st, AT_SYMLINK_NOFOLLOW) == 0 &&
+		S_ISSOCK(st.st_mode) ? 1 : 0;
+}
+
+/* Rebuild the set from the directory, returns the number of changes. */
+static int dirwatch_scan(DirWatch *w)
+{
+	uint64_t old[DIRWATCH_WORDS];
+	int fd, i, n = 0;
+
+	fd = openat(w->dfd, ".", O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+	if (fd < 0) {
+		return -1;
+	}
+	DIR *d = fdopendir(fd);
+	if (d == NULL) {
+		close(fd);
+		return -1;
+	}
+
+	memcpy(old, w->addrs, sizeof(old));
+	memset(w->addrs, 0, sizeof(w->addrs));
+
+	struct dirent *de;
+	while ((de = readdir(d)) != NULL) {
+		int addr = dirwatch_addr(de->d_name);
+		if (addr < 0) {
+			continue;
+		}
+		if (de->d_type == DT_SOCK || (de->d_type == DT_UNKNOWN &&
+		    dirwatch_is_sock(w, de->d_name))) {
+			dirwatch_set(w, addr, 1);
+		}
+	}
+	closedir(d);
+
+	for (i = 0; i < DIRWATCH_WORDS; i++) {
+		n += __builtin_popcountll(old[i] ^ w->addrs[i]);
+	}
+	return n;
+}
+
+#ifdef HAVE_INOTIFY
+
+DirWatch *dirwatch_open(const char *dir)
+{
+	DirWatch *w = calloc(1, sizeof(*w));
+	if (w == NULL) {
+		return NULL;
+	}
+
+	w->fd = -1;
+	w->dfd = open(dir, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+	if (w->dfd < 0) {
+		free(w);
+		return NULL;
+	}
+
+	w->fd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+	if (w->fd < 0) {
+		goto fail;
+	}
+
+	/* Watch first, sockets created during the scan are not lost. */
+	if (inotify_add_watch(w->fd, dir, IN_CREATE | IN_DELETE |
+				IN_MOVED_FROM | IN_MOVED_TO | IN_ONLYDIR) < 0) {
+		goto fail;
+	}
+	if (dirwatch_scan(w) < 0) {
+		goto fail;
+	}
+
+	return w;
+
+fail:;
+	int e = errno;
+	dirwatch_close(w);
+	errno = e;
+	return NULL;
+}
+
+int dirwatch_read(DirWatch *w)
+{
+	/* Events are aligned as struct inotify_event. */
+	char buf[4096]
+		__attribute__((aligned(__alignof__(struct inotify_event))));
+	int n = 0;
+
+	for (;;) {
+		ssize_t len = read(w->fd, buf, sizeof(buf));
+		if (len < 0) {
+			if (errno == EINTR) {
+				continue;
+			}
+			if (errno == EAGAIN) {
+				return n;
+			}
+			return -1;
+		}
+
+		char *p = buf;
+		while (p < buf + len) {
+			const struct inotify_event *ev = (void *)p;
+			p += sizeof(*ev) + ev->len;
+
+			/* Events are lost, the directory is the truth. */
+			if (ev->mask & IN_Q_OVERFLOW) {
+				int rc = dirwatch_scan(w);
+				if (rc < 0) {
+					return -1;
+				}
+				n += rc;
+				continue;
+			}
+
+			int addr = ev->len ? dirwatch_addr(ev->name) : -1;
+			if (addr < 0) {
+				continue;
+			}
+			if (ev->mask & (IN_CREATE | IN_MOVED_TO)) {
+				if (dirwatch_is_sock(w, ev->name)) {
+					n += dirwatch_set(w, addr, 1);
+				}
+			} else {
+				n += dirwatch_set(w, addr, 0);
+			}
+		}
+	}
+}
+
+#else
+
+DirWatch *dirwatch_open(const char *dir)
+{
+	UNUSED(dir);
+	errno = ENOSYS;
+	return NULL;
+}
+
+int dirwatch_read(DirWatch *w)
+{
+	return dirwatch_scan(w);
+}
+
+#endif
+
+int dirwatch_fd(const DirWatch *w)
+{
+	return w->fd;
+}
+
+int dirwatch_has(const DirWatch *w, int addr)
+{
+	return w->addrs[addr / 64] >> (addr % 64) & 1;
+}
+
+int dirwatch_next(const DirWatch *w, int from)
+{
+	int i = from / 64;
+	uint64_t bits;
+
+	if (from < 0 || from >= DIRWATCH_ADDRS) {
+		return -1;
+	}
+
+	bits = w->addrs[i] & (~(uint64_t)0 << (from % 64));
+	while (!bits) {
+		if (++i == DIRWATCH_WORDS) {
+			return -1;
+		}
+		bits = w->addrs[i];
+	}
+	return i * 64 + __builtin_ctzll(bits);
+}
+
+int dirwatch_count(const DirWatch *w)
+{
+	int i, n = 0;
+
+	for (i = 0; i < DIRWATCH_WORDS; i++) {
+		n += __builtin_popcountll(w->addrs[i]);
+	}
+	return n;
+}
+
+void dirwatch_close(DirWatch *w)
+{
+	/* The fd might be registered in the loop. */
+	if (w->fd >= 0) {
+		loop_fd_close(w->fd);
+	}
+	if (w->dfd >= 0) {
+		close(w->dfd);
+	}
+	free(w);
+}
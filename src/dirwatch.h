@@ -0,0 +1,36 @@
+#ifndef DIRWATCH_H
+#define DIRWATCH_H
+
+#include <stdint.h>
+
+/*
+ * A live set of addresses which have socket files in a directory, the unix
+ * transport names sockets by the address. The directory is scanned once
+ * when the watch is opened, then inotify reports sockets created and
+ * removed. Without HAVE_INOTIFY dirwatch_open() fails with ENOSYS.
+ */
+#define DIRWATCH_ADDRS		256
+#define DIRWATCH_WORDS		(DIRWATCH_ADDRS / 64)
+
+typedef struct DirWatch DirWatch;
+
+DirWatch *dirwatch_open(const char *dir);
+
+/* The fd to wait for readability before dirwatch_read(). */
+int dirwatch_fd(const DirWatch *w);
+
+/* Apply pending events, returns the number of changed addresses. */
+int dirwatch_read(DirWatch *w);
+
+int dirwatch_has(const DirWatch *w, int addr);
+
+/* The lowest address in the set not less than from, -1 if there's none. */
+int dirwatch_next(const DirWatch *w, int from);
+
+/* The number of addresses in the set. */
+int dirwatch_count(const DirWatch *w);
+
+/* Closes the fd through the loop, it is deleted from there if added. */
+void dirwatch_close(DirWatch *w);
+
+#endif
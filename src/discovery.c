@@ -0,0 +1,184 @@
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+
+#include "utils.h"
+#include "proto.h"
+#include "discovery.h"
+
+/* u32 magic | u8 version | u8 flags | u8 role | u8 host | u32 epoch
+ * With DISC_F_AGGR: | u32 cycle | u32 count | u32 temp_sum | u32 brgth_sum |
+ * u16 temp_min | u16 temp_max | u16 brgth_min | u16 brgth_max */
+#define DISC_MAGIC		0x44434c54	/* "TLCD" */
+#define DISC_VERSION		1
+#define DISC_MSG_SIZE		12
+#define DISC_AGGR_SIZE		(DISC_MSG_SIZE + 24)
+
+static struct sockaddr_in disc_dst;
+
+static int discovery_parse(const char *spec, int *mcast,
+				struct sockaddr_in *sin, struct in_addr *ifaddr)
+{
+	char addr[64], ifname[64];
+	int port, n;
+
+	if (!strncmp(spec, "mcast:", 6)) {
+		*mcast = 1;
+	} else if (!strncmp(spec, "bcast:", 6)) {
+		*mcast = 0;
+	} else {
+		return -1;
+	}
+
+	n = sscanf(spec + 6, "%63[^:]:%d:%63s", addr, &port, ifname);
+	if (n < 2 || (n == 3 && !*mcast) || port <= 0 || port > 65535) {
+		return -1;
+	}
+
+	ifaddr->s_addr = htonl(INADDR_ANY);
+	if (n == 3 && inet_pton(AF_INET, ifname, ifaddr) != 1) {
+		return -1;
+	}
+
+	memset(sin, 0, sizeof(*sin));
+	sin->sin_family = AF_INET;
+	sin->sin_port = htons(port);
+	return inet_pton(AF_INET, addr, &sin->sin_addr) == 1 ? 0 : -1;
+}
+
+/* Multicast datagrams are looped back so nodes on the same host hear each
+ * other, INADDR_ANY leaves the interface to the routing table. */
+static int discovery_mcast_join(int fd, const struct sockaddr_in *group,
+				struct in_addr ifaddr)
+{
+	struct ip_mreq mreq;
+	unsigned char on = 1, ttl = 1;
+
+	mreq.imr_multiaddr = group->sin_addr;
+	mreq.imr_interface = ifaddr;
+
+	return setsockopt(fd, IPPROTO_IP, IP_ADD_MEMBERSHIP,
+				&mreq, sizeof(mreq)) < 0 ||
+	       setsockopt(fd, IPPROTO_IP, IP_MULTICAST_IF,
+				&ifaddr, sizeof(ifaddr)) < 0 ||
+	       setsockopt(fd, IPPROTO_IP, IP_MULTICAST_LOOP,
+				&on, sizeof(on)) < 0 ||
+	       setsockopt(fd, IPPROTO_IP, IP_MULTICAST_TTL,
+				&ttl, sizeof(ttl)) < 0 ? -1 : 0;
+}
+
+int discovery_open(const char *spec)
+{
+	struct sockaddr_in sin;
+	struct in_addr ifaddr;
+	int fd, mcast, on = 1;
+
+	if (discovery_parse(spec, &mcast, &disc_dst, &ifaddr) < 0) {
+		errno = EINVAL;
+		return -1;
+	}
+
+	fd = socket(AF_INET, SOCK_DGRAM, 0);
+	if (fd < 0) {
+		return -1;
+	}
+
+	/* All nodes of the host bind the same port and get own copies. */
+	memset(&sin, 0, sizeof(sin));
+	sin.sin_family = AF_INET;
+	sin.sin_addr.s_addr = htonl(INADDR_ANY);
+	sin.sin_port = disc_dst.sin_port;
+
+	if (setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &on, sizeof(on)) < 0 ||
+	    (!mcast && setsockopt(fd, SOL_SOCKET, SO_BROADCAST,
+					&on, sizeof(on)) < 0) ||
+	    bind(fd, (void *)&sin, sizeof(sin)) < 0 ||
+	    (mcast && discovery_mcast_join(fd, &disc_dst, ifaddr) < 0) ||
+	    fd_nonblock(fd) < 0) {
+		close(fd);
+		return -1;
+	}
+
+	return fd;
+}
+
+int discovery_send(int fd, const DiscoveryMsg *m)
+{
+	uint8_t buf[DISC_AGGR_SIZE];
+	size_t size = DISC_MSG_SIZE;
+	ssize_t n;
+
+	put_le32(buf, DISC_MAGIC);
+	buf[4] = DISC_VERSION;
+	buf[5] = m->flags;
+	buf[6] = m->role;
+	buf[7] = m->host;
+	put_le32(buf + 8, m->epoch);
+
+	/* Nodes which don't know aggregates skip the longer datagram. */
+	if (m->flags & DISC_F_AGGR) {
+		put_le32(buf + 12, m->aggr.cycle);
+		put_le32(buf + 16, m->aggr.count);
+		put_le32(buf + 20, m->aggr.temp_sum);
+		put_le32(buf + 24, m->aggr.brgth_sum);
+		put_le16(buf + 28, m->aggr.temp_min);
+		put_le16(buf + 30, m->aggr.temp_max);
+		put_le16(buf + 32, m->aggr.brgth_min);
+		put_le16(buf + 34, m->aggr.brgth_max);
+		size = DISC_AGGR_SIZE;
+	}
+
+	do {
+		n = sendto(fd, buf, size, 0,
+				(void *)&disc_dst, sizeof(disc_dst));
+	} while (n < 0 && errno == EINTR);
+
+	return n == (ssize_t)size ? 0 : -1;
+}
+
+int discovery_recv(int fd, DiscoveryMsg *m)
+{
+	uint8_t buf[DISC_AGGR_SIZE + 1];
+	ssize_t n;
+
+	for (;;) {
+		n = recv(fd, buf, sizeof(buf), 0);
+		if (n < 0) {
+			if (errno == EINTR) {
+				continue;
+			}
+			return errno == EAGAIN || errno == EWOULDBLOCK ? 0 : -1;
+		}
+
+		/* Skip foreign datagrams. */
+		if (n < DISC_MSG_SIZE || get_le32(buf) != DISC_MAGIC ||
+		    buf[4] != DISC_VERSION ||
+		    n != (buf[5] & DISC_F_AGGR ? DISC_AGGR_SIZE :
+						 DISC_MSG_SIZE)) {
+			continue;
+		}
+
+		m->flags = buf[5];
+		m->role  = buf[6];
+		m->host  = buf[7];
+		m->epoch = get_le32(buf + 8);
+		if (m->flags & DISC_F_AGGR) {
+			m->aggr.cycle = get_le32(buf + 12);
+			m->aggr.count = get_le32(buf + 16);
+			m->aggr.temp_sum = get_le32(buf + 20);
+			m->aggr.brgth_sum = get_le32(buf + 24);
+			m->aggr.temp_min = get_le16(buf + 28);
+			m->aggr.temp_max = get_le16(buf + 30);
+			m->aggr.brgth_min = get_le16(buf + 32);
+			m->aggr.brgth_max = get_le16(buf + 34);
+		}
+		return 1;
+	}
+}
@@ -0,0 +1,49 @@
+#ifndef DISCOVERY_H
+#define DISCOVERY_H
+
+#include <stdint.h>
+
+/*
+ * Every node announces its address, role and epoch with a datagram sent to
+ * a multicast group or a broadcast address, so a single datagram reaches
+ * all live nodes. spec is "mcast:group:port[:ifaddr]" or "bcast:addr:port",
+ * ifaddr selects the interface by its address, the routing table picks it
+ * by default, e.g. "mcast:239.255.42.1:7400:127.0.0.1".
+ */
+#define DISCOVERY_DEFAULT	"mcast:239.255.42.1:7400"
+
+#define DISC_F_QUERY		0x01	/* ask live nodes to announce */
+#define DISC_F_LEAVE		0x02	/* the node is stopped */
+#define DISC_F_AGGR		0x04	/* aggr holds a partial aggregate */
+
+typedef struct DiscoveryAggr DiscoveryAggr;
+typedef struct DiscoveryMsg DiscoveryMsg;
+
+/* Readings of the address range polled by a controller. */
+struct DiscoveryAggr {
+	uint32_t	cycle;
+	uint32_t	count;
+	uint32_t	temp_sum;
+	uint32_t	brgth_sum;
+	uint16_t	temp_min;
+	uint16_t	temp_max;
+	uint16_t	brgth_min;
+	uint16_t	brgth_max;
+};
+
+struct DiscoveryMsg {
+	uint8_t		flags;
+	uint8_t		role;
+	uint8_t		host;
+	uint32_t	epoch;
+	DiscoveryAggr	aggr;		/* with DISC_F_AGGR */
+};
+
+int discovery_open(const char *spec);
+
+int discovery_send(int fd, const DiscoveryMsg *m);
+
+/* 1 - a message is received, 0 - no more datagrams, -1 - error. */
+int discovery_recv(int fd, DiscoveryMsg *m);
+
+#endif
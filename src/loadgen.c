@@ -0,0 +1,605 @@
+#include <sys/types.h>
+#include <sys/socket.h>
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <time.h>
+#include <errno.h>
+#include <err.h>
+
+#include "loop.h"
+#include "utils.h"
+#include "proto.h"
+#include "transport.h"
+
+/*
+ * Load generator for a single sensor: loadgen [options] addr
+ *
+ * The closed loop keeps a request in flight on every connection, the open
+ * loop issues requests at a fixed rate whatever the replies are, arrivals
+ * which find no free connection wait in a backlog and their latency counts
+ * from the scheduled time, so a slow sensor can't hide its queueing.
+ */
+#define LG_BUF_SIZE		512
+#define LG_CONNS_MAX		1024
+#define LG_BACKLOG		4096
+#define LG_TICK			1	/* open loop arrival tick in msec */
+
+enum {
+	CONN_CLOSED,
+	CONN_CONNECTING,
+	CONN_IDLE,			/* connected v2, waits for a request */
+	CONN_BUSY,			/* a request is in flight */
+};
+
+enum {
+	ERR_NONE,
+	ERR_CONNECT,			/* connect failed */
+	ERR_RESET,			/* closed or reset by the sensor */
+	ERR_TIMEOUT,			/* no reply in time */
+	ERR_PROTO,			/* malformed or unexpected reply */
+	ERR_OVERFLOW,			/* open loop arrivals not served */
+	ERR_MAX
+};
+
+static const char *err_names[ERR_MAX] = {
+	"none", "connect", "reset", "timeout", "proto", "overflow"
+};
+
+typedef struct Conn Conn;
+
+struct Conn {
+	int		fd;
+	int		state;
+	int		reqs;		/* replies on the connection */
+	int		hello;		/* HELLO is in flight */
+	int64_t		start;		/* usec the request was issued */
+	uint32_t	id;
+	LoopTimer	timer;
+	size_t		off;
+	size_t		left;
+	TlvDecoder	dec;
+	uint8_t		buf[LG_BUF_SIZE];
+};
+
+static struct {
+	const Transport	*tr;
+	int		addr;
+	int		proto;		/* PROTO_V1 or PROTO_V2 */
+	int		nconns;
+	int		rate;		/* requests per sec, 0 - closed loop */
+	int		hello_pct;	/* HELLO share of requests */
+	int		msg_size;	/* GET text length */
+	int		reuse;		/* v2 requests per connection, 0 - all */
+	int		timeout;	/* msec */
+	int64_t		duration;	/* msec */
+	long		total;		/* requests to issue, 0 - by duration */
+} opt = {
+	.proto = PROTO_V2,
+	.nconns = 16,
+	.timeout = 1000,
+	.duration = 5000,
+	.msg_size = 32,
+};
+
+static Conn *conns;
+static char text[LG_BUF_SIZE];
+static int64_t t_start, t_end;
+static long issued, arrivals, inflight, replies, hellos, connects;
+static long errors[ERR_MAX];
+static int stopping;
+static LoopTimer tick_timer, stop_timer;
+
+static int64_t *lat;			/* reply latencies in usec */
+static size_t lat_n, lat_size;
+
+/* Open loop arrivals waiting for a free connection. */
+static int64_t backlog[LG_BACKLOG];
+static size_t bl_head, bl_n;
+
+static int64_t clock_usec(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (int64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+static void lat_add(int64_t usec)
+{
+	if (lat_n == lat_size) {
+		lat_size = lat_size ? 2 * lat_size : 4096;
+		lat = realloc(lat, lat_size * sizeof(*lat));
+		if (lat == NULL) {
+			err(EXIT_FAILURE, "realloc()");
+		}
+	}
+	lat[lat_n++] = usec;
+}
+
+static void conn_event(int fd, LoopEvent event, void *opaque);
+static void work_next(Conn *c);
+
+static void conn_close(Conn *c)
+{
+	if (c->fd != -1) {
+		loop_fd_close(c->fd);
+		c->fd = -1;
+	}
+	loop_timer_cancel(&c->timer);
+	c->state = CONN_CLOSED;
+}
+
+static void req_done(Conn *c, int error)
+{
+	inflight--;
+	if (error == ERR_NONE) {
+		replies++;
+		hellos += c->hello;
+		c->reqs++;
+		lat_add(clock_usec() - c->start);
+	} else {
+		errors[error]++;
+	}
+
+	/* v1 serves a single request per connection. */
+	if (error != ERR_NONE || opt.proto == PROTO_V1 ||
+	    (opt.reuse && c->reqs >= opt.reuse)) {
+		conn_close(c);
+	} else {
+		loop_timer_cancel(&c->timer);
+		loop_fd_change(c->fd, LOOP_RD);
+		c->state = CONN_IDLE;
+	}
+
+	work_next(c);
+}
+
+static void req_build(Conn *c)
+{
+	c->hello = rand() % 100 < opt.hello_pct;
+	c->off = 0;
+
+	if (opt.proto == PROTO_V1) {
+		TlvValue vals[TLV_FIELDS_MAX] = { { 0 } };
+
+		if (c->hello) {
+			c->buf[0] = MSG_HELLO;
+			c->left = 1;
+			return;
+		}
+		if (opt.msg_size) {
+			vals[GET_TEXT].set = 1;
+			vals[GET_TEXT].str = text;
+			vals[GET_TEXT].len = opt.msg_size;
+			vals[GET_BRGHT].set = 1;
+			vals[GET_BRGHT].u16 = 50;
+		}
+		c->left = tlv_encode(&proto_get_schema, c->buf,
+					sizeof(c->buf), vals);
+		tlv_decoder_init(&c->dec, &proto_res_schema);
+		return;
+	}
+
+	uint8_t *q;
+
+	c->id++;
+	if (c->hello) {
+		q = proto_frame_begin(c->buf, MSG2_HELLO, c->id);
+		*q = PROTO_V2;
+		c->left = proto_frame_end(c->buf, 1);
+		return;
+	}
+
+	q = proto_frame_begin(c->buf, MSG2_GET, c->id);
+	q[0] = opt.msg_size ? GET2_F_BRGHT | GET2_F_TEXT : 0;
+	q[1] = 1;
+	put_le16(q + 2, opt.msg_size ? 50 : 0);
+	/* A new epoch every request, so the text is always processed. */
+	put_le32(q + 4, opt.msg_size ? c->id : 0);
+	q[8] = opt.msg_size;
+	memcpy(q + GET2_FIXED_SIZE, text, opt.msg_size);
+	c->left = proto_frame_end(c->buf, GET2_FIXED_SIZE + opt.msg_size);
+}
+
+static void req_issue(Conn *c, int64_t start)
+{
+	issued++;
+	inflight++;
+	c->start = start;
+	loop_timer_set(&c->timer, opt.timeout);
+
+	if (c->state == CONN_IDLE) {
+		c->state = CONN_BUSY;
+		req_build(c);
+		loop_fd_change(c->fd, LOOP_WR);
+		return;
+	}
+
+	c->reqs = 0;
+	c->fd = opt.tr->connect(opt.addr, 1);
+	if (c->fd < 0) {
+		inflight--;
+		errors[ERR_CONNECT]++;
+		c->state = CONN_CLOSED;
+		/* Retry on the next tick instead of spinning on a dead sensor. */
+		loop_timer_set(&c->timer, LG_TICK);
+		return;
+	}
+	connects++;
+	c->state = CONN_CONNECTING;
+	loop_fd_add(c->fd, LOOP_WR, conn_event, c);
+}
+
+static int can_issue(void)
+{
+	if (stopping) {
+		return 0;
+	}
+	return !opt.total || (opt.rate ? arrivals : issued) < opt.total;
+}
+
+static void run_check(void)
+{
+	if (!inflight && !bl_n && !can_issue()) {
+		loop_quit();
+	}
+}
+
+/* A freed connection takes the next request of its mode. */
+static void work_next(Conn *c)
+{
+	if (opt.rate) {
+		if (bl_n && !stopping) {
+			int64_t start = backlog[bl_head];
+			bl_head = (bl_head + 1) % LG_BACKLOG;
+			bl_n--;
+			req_issue(c, start);
+		}
+	} else if (can_issue()) {
+		req_issue(c, clock_usec());
+	}
+
+	run_check();
+}
+
+/* 1 - partial, 0 - complete, -1 - error. */
+static int reply_check(Conn *c)
+{
+	if (opt.proto == PROTO_V1) {
+		if (c->hello) {
+			return c->buf[0] == MSG_HELLO && c->off == 1 ? 0 : -1;
+		}
+		return tlv_decode(&c->dec, c->buf, c->off, sizeof(c->buf));
+	}
+
+	ProtoHdr h;
+	int rc = proto_frame_check(c->buf, c->off, sizeof(c->buf), &h);
+	if (rc != 0) {
+		return rc;
+	}
+
+	return h.id == c->id && h.len == c->off &&
+		h.type == (c->hello ? MSG2_HELLO : MSG2_RES) ? 0 : -1;
+}
+
+static void conn_event(int fd, LoopEvent event, void *opaque)
+{
+	Conn *c = opaque;
+	ssize_t n;
+
+	switch (c->state) {
+	case CONN_CONNECTING:
+		if (!opt.tr->check_connection(fd)) {
+			req_done(c, ERR_CONNECT);
+			return;
+		}
+		c->state = CONN_BUSY;
+		req_build(c);
+		/* fallthrough */
+	case CONN_BUSY:
+		if (c->left) {
+			if (!(event & (LOOP_WR | LOOP_ERR))) {
+				return;
+			}
+			n = send(fd, c->buf + c->off, c->left, MSG_NOSIGNAL);
+			if (n < 0) {
+				if (errno != EAGAIN && errno != EINTR) {
+					req_done(c, ERR_RESET);
+				}
+				return;
+			}
+			c->off += n;
+			c->left -= n;
+			if (!c->left) {
+				c->off = 0;
+				loop_fd_change(fd, LOOP_RD);
+			}
+			return;
+		}
+
+		n = recv(fd, c->buf + c->off, sizeof(c->buf) - c->off, 0);
+		if (n <= 0) {
+			if (n == 0 || (errno != EAGAIN && errno != EINTR)) {
+				req_done(c, ERR_RESET);
+			}
+			return;
+		}
+		c->off += n;
+
+		switch (reply_check(c)) {
+		case 0:
+			req_done(c, ERR_NONE);
+			break;
+		case 1:
+			if (c->off == sizeof(c->buf)) {
+				req_done(c, ERR_PROTO);
+			}
+			break;
+		default:
+			req_done(c, ERR_PROTO);
+			break;
+		}
+		return;
+	case CONN_IDLE:
+		/* The sensor closed an idle connection. */
+		conn_close(c);
+		work_next(c);
+		return;
+	}
+}
+
+static void conn_timeout(LoopTimer *t, void *opaque)
+{
+	Conn *c = opaque;
+
+	UNUSED(t);
+
+	/* A closed connection retries a failed connect. */
+	if (c->state == CONN_CLOSED) {
+		work_next(c);
+	} else {
+		req_done(c, ERR_TIMEOUT);
+	}
+}
+
+static Conn *conn_free(void)
+{
+	int i;
+
+	for (i = 0; i < opt.nconns; i++) {
+		if (conns[i].state == CONN_IDLE) {
+			return &conns[i];
+		}
+	}
+	for (i = 0; i < opt.nconns; i++) {
+		if (conns[i].state == CONN_CLOSED) {
+			return &conns[i];
+		}
+	}
+	return NULL;
+}
+
+/* Arrivals due since the start are issued or put to the backlog. */
+static void arrival_tick(LoopTimer *t, void *opaque)
+{
+	int64_t now = clock_usec();
+	long due = (now - t_start) * opt.rate / 1000000;
+
+	UNUSED(opaque);
+
+	while (due > arrivals && can_issue()) {
+		int64_t start = t_start + arrivals++ * 1000000 / opt.rate;
+		Conn *c = conn_free();
+
+		/* The tick lag is ours, not the sensor's. */
+		if (c != NULL) {
+			req_issue(c, now);
+		} else if (bl_n < LG_BACKLOG) {
+			backlog[(bl_head + bl_n++) % LG_BACKLOG] = start;
+		} else {
+			errors[ERR_OVERFLOW]++;
+		}
+	}
+
+	if (can_issue()) {
+		loop_timer_set(t, LG_TICK);
+	} else {
+		run_check();
+	}
+}
+
+static void stop_tick(LoopTimer *t, void *opaque)
+{
+	UNUSED(t);
+	UNUSED(opaque);
+
+	stopping = 1;
+	t_end = clock_usec();
+	loop_timer_cancel(&tick_timer);
+	/* Waiting arrivals are never served. */
+	errors[ERR_OVERFLOW] += bl_n;
+	bl_n = 0;
+	run_check();
+}
+
+static int lat_cmp(const void *a, const void *b)
+{
+	int64_t x = *(const int64_t *)a, y = *(const int64_t *)b;
+
+	return x < y ? -1 : x > y;
+}
+
+static int64_t lat_pct(double p)
+{
+	size_t i = (size_t)(p / 100 * lat_n);
+
+	return lat[i < lat_n ? i : lat_n - 1];
+}
+
+static void report(void)
+{
+	double secs = (t_end - t_start) / 1e6;
+	int i;
+
+	printf("%ld replies in %.3f s: %.1f req/s, %ld HELLO, "
+		"%ld connections\n", replies, secs,
+		secs > 0 ? replies / secs : 0.0, hellos, connects);
+
+	if (lat_n) {
+		qsort(lat, lat_n, sizeof(*lat), lat_cmp);
+		printf("latency usec: min %lld p50 %lld p90 %lld p99 %lld "
+			"p99.9 %lld max %lld\n", (long long)lat[0],
+			(long long)lat_pct(50), (long long)lat_pct(90),
+			(long long)lat_pct(99), (long long)lat_pct(99.9),
+			(long long)lat[lat_n - 1]);
+	}
+
+	printf("errors:");
+	for (i = ERR_CONNECT; i < ERR_MAX; i++) {
+		printf(" %s %ld", err_names[i], errors[i]);
+	}
+	printf("\n");
+}
+
+static void usage(void)
+{
+	fprintf(stderr, "usage: loadgen [-t transport] [-v 1|2] [-c conns] "
+			"[-r rate] [-n requests]\n"
+			"               [-d msec] [-m hello%%] [-s size] "
+			"[-k reuse] [-T msec] addr\n"
+		"  -c  concurrent connections (16)\n"
+		"  -r  open loop requests per sec, closed loop by default\n"
+		"  -n  requests to issue, otherwise run for -d msec (5000)\n"
+		"  -m  percent of HELLO requests (0)\n"
+		"  -s  GET text length, 0 sends GET without text (32)\n"
+		"  -k  v2 requests per connection, 0 keeps it open (0)\n"
+		"  -T  reply timeout in msec (1000)\n");
+	exit(EXIT_FAILURE);
+}
+
+int main(int argc, char *argv[])
+{
+	const char *trname = NULL, *s;
+	int c, i;
+
+	while ((c = getopt(argc, argv, "t:v:c:r:n:d:m:s:k:T:")) != -1) {
+		switch (c) {
+		case 't':
+			trname = optarg;
+			break;
+		case 'v':
+			opt.proto = atoi(optarg);
+			break;
+		case 'c':
+			opt.nconns = atoi(optarg);
+			break;
+		case 'r':
+			opt.rate = atoi(optarg);
+			break;
+		case 'n':
+			opt.total = atol(optarg);
+			break;
+		case 'd':
+			opt.duration = atoi(optarg);
+			break;
+		case 'm':
+			opt.hello_pct = atoi(optarg);
+			break;
+		case 's':
+			opt.msg_size = atoi(optarg);
+			break;
+		case 'k':
+			opt.reuse = atoi(optarg);
+			break;
+		case 'T':
+			opt.timeout = atoi(optarg);
+			break;
+		default:
+			usage();
+		}
+	}
+
+	if (optind + 1 != argc) {
+		usage();
+	}
+	opt.addr = atoi(argv[optind]);
+
+	/* v2 text length is a single byte. */
+	if (opt.addr < 0 || opt.addr > 255 ||
+	    (opt.proto != PROTO_V1 && opt.proto != PROTO_V2) ||
+	    opt.nconns <= 0 || opt.nconns > LG_CONNS_MAX ||
+	    opt.rate < 0 || opt.total < 0 || opt.duration <= 0 ||
+	    opt.hello_pct < 0 || opt.hello_pct > 100 ||
+	    opt.msg_size < 0 || opt.msg_size > 255 ||
+	    opt.reuse < 0 || opt.timeout <= 0) {
+		usage();
+	}
+
+	opt.tr = transport_find(trname ? trname : getenv("TRANSPORT"));
+	if (opt.tr == NULL) {
+		errx(EXIT_FAILURE, "unknown transport");
+	}
+	const char *base = getenv("TCP_BASE");
+	s = getenv("TCP_PORT");
+	if (transport_tcp_setup(base ? base : TRANSPORT_TCP_BASE,
+				s ? atoi(s) : TRANSPORT_TCP_PORT,
+				getenv("TRANSPORT_MAP")) < 0) {
+		errx(EXIT_FAILURE, "invalid TCP_BASE, TCP_PORT or TRANSPORT_MAP");
+	}
+
+	for (i = 0; i < opt.msg_size; i++) {
+		text[i] = 'a' + i % 26;
+	}
+
+	if (loop_init(LOOP_DRV_DEFAULT) < 0) {
+		errx(EXIT_FAILURE, "loop_init()");
+	}
+
+	conns = calloc(opt.nconns, sizeof(*conns));
+	if (conns == NULL) {
+		err(EXIT_FAILURE, "calloc()");
+	}
+
+	srand(getpid());
+	t_start = clock_usec();
+	t_end = t_start;
+
+	for (i = 0; i < opt.nconns; i++) {
+		conns[i].fd = -1;
+		loop_timer_init(&conns[i].timer, conn_timeout, &conns[i]);
+	}
+
+	/* Without -n the run is limited by the duration. */
+	loop_timer_init(&stop_timer, stop_tick, NULL);
+	if (!opt.total) {
+		loop_timer_set(&stop_timer, opt.duration);
+	}
+
+	if (opt.rate) {
+		loop_timer_init(&tick_timer, arrival_tick, NULL);
+		loop_timer_set(&tick_timer, LG_TICK);
+	} else {
+		for (i = 0; i < opt.nconns && can_issue(); i++) {
+			req_issue(&conns[i], clock_usec());
+		}
+	}
+
+	loop_run();
+
+	if (opt.total) {
+		t_end = clock_usec();
+	}
+
+	report();
+
+	for (i = 0; i < opt.nconns; i++) {
+		conn_close(&conns[i]);
+	}
+	loop_fini();
+	free(conns);
+	free(lat);
+	return EXIT_SUCCESS;
+}
@@ -9,7 +9,9 @@
 #include <unistd.h>
 #include <errno.h>
 
+#include "utils.h"
 #include "loop.h"
+#include "probes.h"
 
 typedef void * LoopDrvCtx;
 typedef struct LoopDrv LoopDrv;
@@ -34,7 +36,10 @@ struct LoopDrv {
 	void		*(*init)(void);
 	void		 (*set)(LoopDrvCtx *, Fd, LoopEvent);
 	void		 (*del)(LoopDrvCtx *, Fd);
-	int		 (*run)(LoopDrvCtx *, void (*notify)(Fd, LoopEvent));
+	/* Forget fd which is closed without telling the kernel. */
+	void		 (*forget)(LoopDrvCtx *, Fd);
+	int		 (*run)(LoopDrvCtx *, int timeout,
+					void (*notify)(Fd, LoopEvent));
 	void		 (*fini)(LoopDrvCtx *);
 };
 
@@ -103,12 +108,20 @@ static void do_len_ensure(Array *a, int n)
 
 static void fd2id_init(void *);
 static void ent_init(void *);
+static void zero_init(void *);
+static int fdcheck(Fd fd);
 
 static LoopDrv		*loopdrv;
 static LoopDrvCtx	*loopdrvctx;
 static ARRAY(int)	fd2id		= ARRAY_INIT(int, fd2id_init);
 static ARRAY(LoopEntry)	loopents	= ARRAY_INIT(LoopEntry, ent_init);
 static ARRAY(Event)	event		= ARRAY_INIT(Event, NULL);
+static ARRAY(LoopTimer *) timers	= ARRAY_INIT(LoopTimer *, NULL);
+static ARRAY(LoopTask *) tasks	= ARRAY_INIT(LoopTask *, NULL);
+/* Interest changes are committed to the driver right before the wait. */
+static ARRAY(Fd)	pending		= ARRAY_INIT(Fd, NULL);
+static ARRAY(char)	pendmark	= ARRAY_INIT(char, zero_init);
+static ARRAY(char)	drvevents	= ARRAY_INIT(char, zero_init);
 static int		quit;
 
 typedef struct SelectCtx SelectCtx;
@@ -179,17 +192,27 @@ static void select_del(LoopDrvCtx *c, Fd fd)
 	FD_CLR(fd, ctx->iwr);
 }
 
-static int select_run(LoopDrvCtx *c, void (*notify)(Fd, LoopEvent))
+#define select_forget	select_del
+
+static int
+select_run(LoopDrvCtx *c, int timeout, void (*notify)(Fd, LoopEvent))
 {
 	SelectCtx *ctx = (SelectCtx *)c;
+	struct timeval tv, *tvp = NULL;
 	LoopEvent events;
 	int rc;
 	Fd i;
 
 	memcpy(ctx->ord, ctx->ird, ctx->setsz);
 	memcpy(ctx->owr, ctx->iwr, ctx->setsz);
+
+	if (timeout >= 0) {
+		tv.tv_sec  = timeout / 1000;
+		tv.tv_usec = timeout % 1000 * 1000;
+		tvp = &tv;
+	}
 	
-	if ((rc = select(ctx->fdmax+1, ctx->ord, ctx->owr, NULL, NULL)) < 0)
+	if ((rc = select(ctx->fdmax+1, ctx->ord, ctx->owr, NULL, tvp)) < 0)
 		return rc;
 	else if (!rc)
 		return 0;
@@ -290,7 +313,10 @@ static void poll_del(LoopDrvCtx *c, Fd fd)
 	//printf("                    POLL %u\n", array_len(&ctx->set));
 }
 
-static int poll_run(LoopDrvCtx *c, void (*notify)(Fd, LoopEvent))
+#define poll_forget	poll_del
+
+static int
+poll_run(LoopDrvCtx *c, int timeout, void (*notify)(Fd, LoopEvent))
 {
 	PollCtx *ctx = (PollCtx *)c;
 	PollFd *fds;
@@ -302,7 +328,7 @@ static int poll_run(LoopDrvCtx *c, void (*notify)(Fd, LoopEvent))
 	fds  = &array_get(&ctx->set, 0);
 	nfds = array_len(&ctx->set);
 
-	if ((rc = poll(fds, nfds, -1)) < 0)
+	if ((rc = poll(fds, nfds, timeout)) < 0)
 		return rc;
 
 	for (i = 0; rc && i < nfds; i++) {
@@ -390,42 +416,66 @@ static void epoll_set(LoopDrvCtx *c, Fd fd, LoopEvent events)
 	e.events |= events & LOOP_WR ? EPOLLOUT : 0;
 
 	rc = epoll_ctl(ctx->efd, op, fd, &e);
+	/* The fd was closed and reused before its removal was committed,
+	 * close has removed it from the set already. */
+	if (rc < 0 && op == EPOLL_CTL_MOD && errno == ENOENT)
+		rc = epoll_ctl(ctx->efd, EPOLL_CTL_ADD, fd, &e);
 	if (rc < 0)
 		perror("epoll_ctl");
 	assert(rc == 0);
 }
 
-static void epoll_del(LoopDrvCtx *c, Fd fd)
+static void epoll_forget(LoopDrvCtx *c, Fd fd)
 {
 	EPollCtx *ctx = (EPollCtx *)c;
-	EPollEvent e = { 0, { 0 } };
-	int n, rc;
 
 	assert(fd < array_len(&ctx->index));
-	n = array_get(&ctx->index, fd);
 	/* Fd already is not inside the backend. */
-	if (n == -1)
+	if (array_get(&ctx->index, fd) == -1)
 		return;
 	array_put(&ctx->index, fd, -1);
 	--array_len(&ctx->events);
 	//printf("                    EPOLL %u\n", array_len(&ctx->events));
+}
+
+static void epoll_del(LoopDrvCtx *c, Fd fd)
+{
+	EPollCtx *ctx = (EPollCtx *)c;
+	EPollEvent e = { 0, { 0 } };
+	int rc;
+
+	assert(fd < array_len(&ctx->index));
+	/* Fd already is not inside the backend. */
+	if (array_get(&ctx->index, fd) == -1)
+		return;
+	epoll_forget(c, fd);
 	rc = epoll_ctl(ctx->efd, EPOLL_CTL_DEL, fd, &e);
+	/* The fd was closed before its removal was committed. */
+	if (rc < 0 && (errno == EBADF || errno == ENOENT))
+		rc = 0;
 	if (rc < 0)
 		perror("epoll_ctl");
 	assert(rc == 0);
 }
 
-static int epoll_run(LoopDrvCtx *c, void (*notify)(Fd, LoopEvent))
+static int
+epoll_run(LoopDrvCtx *c, int timeout, void (*notify)(Fd, LoopEvent))
 {
 	EPollCtx *ctx = (EPollCtx *)c;
 	int rc, i, nfds, revents;
-	EPollEvent *fds;
+	EPollEvent *fds, dummy;
 	LoopEvent events;
 
 	fds  = &array_get(&ctx->events, 0);
 	nfds = array_len(&ctx->events);
 
-	if ((rc = epoll_wait(ctx->efd, fds, nfds, -1)) < 0)
+	/* Without fds the wait still sleeps until the next timer. */
+	if (!nfds) {
+		fds  = &dummy;
+		nfds = 1;
+	}
+
+	if ((rc = epoll_wait(ctx->efd, fds, nfds, timeout)) < 0)
 		return rc;
 
 	for (i = 0; i < rc; i++) {
@@ -458,7 +508,8 @@ static void epoll_fini(LoopDrvCtx *c)
 #endif
 
 #define LOOPDRV(name) \
-	{ name##_init, name##_set, name##_del, name##_run, name##_fini }
+	{ name##_init, name##_set, name##_del, name##_forget, name##_run, \
+	  name##_fini }
 static LoopDrv loopdrvs[] = {
 	LOOPDRV(select),
 	LOOPDRV(poll),
@@ -477,6 +528,46 @@ static void ent_init(void *e)
 	((LoopEntry *)e)->fd = -1;
 }
 
+static void zero_init(void *c)
+{
+	*(char *)c = 0;
+}
+
+static void pending_mark(Fd fd)
+{
+	if (fd >= array_len(&pendmark)) {
+		array_put(&pendmark, fd, 0);
+		array_put(&drvevents, fd, 0);
+	}
+	if (array_get(&pendmark, fd))
+		return;
+	array_put(&pendmark, fd, 1);
+	array_push(&pending, fd);
+}
+
+/* Apply the last interest of every changed fd, fds which are added and
+ * deleted between two waits never reach the driver. */
+static void pending_commit(void)
+{
+	LoopEvent events, have;
+	Fd fd;
+	int i;
+
+	for (i = 0; i < array_len(&pending); i++) {
+		fd = array_get(&pending, i);
+		array_put(&pendmark, fd, 0);
+		events = fdcheck(fd) ?
+			array_get(&loopents, array_get(&fd2id, fd)).events : 0;
+		have = array_get(&drvevents, fd);
+		if (events == have)
+			continue;
+		events ? loopdrv->set(loopdrvctx, fd, events) :
+			 loopdrv->del(loopdrvctx, fd);
+		array_put(&drvevents, fd, events);
+	}
+	array_reset(&pending);
+}
+
 int loop_fd_add(Fd fd, LoopEvent events, LoopEventCb f, void *opaque)
 {
 	LoopEntry entry = { fd, events & (LOOP_RD | LOOP_WR), f, opaque, -1 };
@@ -491,7 +582,7 @@ int loop_fd_add(Fd fd, LoopEvent events, LoopEventCb f, void *opaque)
 	id = array_len(&loopents);
 	array_put(&loopents, id, entry);
 	array_put(&fd2id, fd, id);
-	loopdrv->set(loopdrvctx, fd, events);
+	pending_mark(fd);
 
 	return 0;
 }
@@ -529,7 +620,7 @@ int loop_fd_change(Fd fd, LoopEvent events)
 	if (array_get(&loopents, id).events == events)
 		return 0;
 	array_get(&loopents, id).events = events;
-	events ? loopdrv->set(loopdrvctx, fd, events) : loopdrv->del(loopdrvctx, fd);
+	pending_mark(fd);
 
 	return 0;
 }
@@ -546,7 +637,7 @@ int loop_fd_del(Fd fd)
 	if ((active = array_get(&loopents, id).active) != -1)
 		array_get(&event, active).entry = -1;
 	array_put(&fd2id, fd, -1);
-	loopdrv->del(loopdrvctx, fd);
+	pending_mark(fd);
 
 	last = array_len(&loopents)-1;
 	/* Keep the loop array tightly packed, a[id] <- a[last]. */
@@ -562,6 +653,22 @@ int loop_fd_del(Fd fd)
 	return 0;
 }
 
+/* Fds deleted before are closed here too, their removal might not be
+ * committed yet and a reused number would inherit the stale interest. */
+int loop_fd_close(Fd fd)
+{
+	if (fd < 0)
+		return -1;
+	if (fdcheck(fd))
+		loop_fd_del(fd);
+	/* close() removes the fd from the kernel set itself. */
+	if (fd < array_len(&drvevents) && array_get(&drvevents, fd)) {
+		loopdrv->forget(loopdrvctx, fd);
+		array_put(&drvevents, fd, 0);
+	}
+	return close(fd);
+}
+
 int loop_init(LoopDrvType set)
 {
 	if (loopdrv || set >= LOOP_DRV_MAX)
@@ -581,6 +688,11 @@ void loop_fini(void)
 	array_release(&loopents);
 	array_release(&event);
 	array_release(&fd2id);
+	array_release(&timers);
+	array_release(&tasks);
+	array_release(&pending);
+	array_release(&pendmark);
+	array_release(&drvevents);
 }
 
 static void fdnotify(Fd fd, LoopEvent events)
@@ -602,13 +714,178 @@ static void fdnotify(Fd fd, LoopEvent events)
 	}
 }
 
+/* Timers are kept in a binary min-heap ordered by expiration time. */
+static int timer_less(int i, int j)
+{
+	return array_get(&timers, i)->expire < array_get(&timers, j)->expire;
+}
+
+static void timer_swap(int i, int j)
+{
+	LoopTimer *t = array_get(&timers, i);
+
+	array_put(&timers, i, array_get(&timers, j));
+	array_put(&timers, j, t);
+	array_get(&timers, i)->index = i;
+	array_get(&timers, j)->index = j;
+}
+
+static void timer_up(int i)
+{
+	while (i > 0 && timer_less(i, (i - 1) / 2)) {
+		timer_swap(i, (i - 1) / 2);
+		i = (i - 1) / 2;
+	}
+}
+
+static void timer_down(int i)
+{
+	int n = array_len(&timers), l, m;
+
+	for (;;) {
+		m = i;
+		l = 2 * i + 1;
+		if (l < n && timer_less(l, m))
+			m = l;
+		if (l + 1 < n && timer_less(l + 1, m))
+			m = l + 1;
+		if (m == i)
+			break;
+		timer_swap(i, m);
+		i = m;
+	}
+}
+
+void loop_timer_init(LoopTimer *t, LoopTimerCb f, void *opaque)
+{
+	t->expire = 0;
+	t->index  = -1;
+	t->f      = f;
+	t->opaque = opaque;
+}
+
+void loop_timer_cancel(LoopTimer *t)
+{
+	int i = t->index, last;
+
+	if (i == -1)
+		return;
+
+	last = array_len(&timers)-1;
+	if (i != last)
+		timer_swap(i, last);
+	--array_len(&timers);
+	t->index = -1;
+
+	if (i != last) {
+		timer_up(i);
+		timer_down(i);
+	}
+}
+
+void loop_timer_set(LoopTimer *t, int msec)
+{
+	loop_timer_cancel(t);
+	t->expire = clock_msec() + (msec > 0 ? msec : 0);
+	t->index  = array_len(&timers);
+	array_push(&timers, t);
+	timer_up(t->index);
+}
+
+int loop_timer_active(const LoopTimer *t)
+{
+	return t->index != -1;
+}
+
+void loop_task_init(LoopTask *t, LoopTaskCb f, void *opaque)
+{
+	t->index  = -1;
+	t->f      = f;
+	t->opaque = opaque;
+}
+
+void loop_defer(LoopTask *t)
+{
+	if (t->index != -1)
+		return;
+	t->index = array_len(&tasks);
+	array_push(&tasks, t);
+}
+
+void loop_task_cancel(LoopTask *t)
+{
+	if (t->index == -1)
+		return;
+	/* Catch the cancelled task in task_run(). */
+	array_get(&tasks, t->index) = NULL;
+	t->index = -1;
+}
+
+int loop_task_pending(const LoopTask *t)
+{
+	return t->index != -1;
+}
+
+/* Tasks deferred by running tasks are left for the next iteration. */
+static void task_run(void)
+{
+	int i, n = array_len(&tasks);
+	LoopTask *t;
+
+	for (i = 0; i < n; i++) {
+		if ((t = array_get(&tasks, i)) == NULL)
+			continue;
+		array_get(&tasks, i) = NULL;
+		t->index = -1;
+		t->f(t, t->opaque);
+	}
+
+	for (i = n; i < array_len(&tasks); i++) {
+		if ((t = array_get(&tasks, i)) != NULL)
+			t->index = i - n;
+		array_get(&tasks, i - n) = t;
+	}
+	array_len(&tasks) -= n;
+}
+
+/* Wait timeout for the driver, -1 if no timers are armed. */
+static int timer_timeout(void)
+{
+	int64_t d;
+
+	/* Don't sleep while deferred tasks are queued. */
+	if (array_len(&tasks))
+		return 0;
+	if (!array_len(&timers))
+		return -1;
+	d = array_get(&timers, 0)->expire - clock_msec();
+	return d < 0 ? 0 : d;
+}
+
+static void timer_run(void)
+{
+	int64_t now = clock_msec();
+	LoopTimer *t;
+
+	while (array_len(&timers) &&
+	       (t = array_get(&timers, 0))->expire <= now) {
+		loop_timer_cancel(t);
+		t->f(t, t->opaque);
+	}
+}
+
 static void loop_spin(void)
 {
 	LoopEntry *ent;
 	LoopEvent e;
-	int i;
+	int i, rc, timeout;
 
-	if (loopdrv->run(loopdrvctx, fdnotify) < 0)
+	pending_commit();
+	timeout = timer_timeout();
+	PROBE1(loop_wait_enter, timeout);
+	rc = loopdrv->run(loopdrvctx, timeout, fdnotify);
+	PROBE2(loop_wait_exit, rc, array_len(&event));
+	if (rc < 0)
 		return;
 
 	for (i = 0; i < array_len(&event); i++) {
@@ -618,9 +895,13 @@ static void loop_spin(void)
 		ent = &array_get(&loopents, array_get(&event, i).entry);
 		e = array_get(&event, i).events;
 		ent->active = -1;
+		PROBE2(loop_dispatch, ent->fd, e);
 		ent->f(ent->fd, e, ent->opaque);
 	}
 	array_reset(&event);
+
+	timer_run();
+	task_run();
 }
 
 void loop_run(void)
@@ -1,6 +1,8 @@
 #ifndef LOOP_H
 #define LOOP_H
 
+#include <stdint.h>
+
 typedef enum {
 	LOOP_RD	 = 0x01,
 	LOOP_WR  = 0x02,
@@ -25,11 +27,42 @@ typedef enum {
 typedef int Fd;
 typedef void (*LoopEventCb)(Fd, LoopEvent, void *);
 
+typedef struct LoopTimer LoopTimer;
+typedef void (*LoopTimerCb)(LoopTimer *, void *);
+
+/* Timers are owned by callers, the loop only keeps them ordered. */
+struct LoopTimer {
+	int64_t		expire;		/* monotonic msec */
+	int		index;		/* position in the heap, -1 if idle */
+	LoopTimerCb	f;
+	void		*opaque;
+};
+
+typedef struct LoopTask LoopTask;
+typedef void (*LoopTaskCb)(LoopTask *, void *);
+
+/* Deferred tasks run once after I/O dispatch of the current iteration, a task
+ * deferred several times before it runs is run once. */
+struct LoopTask {
+	int		index;		/* position in the queue, -1 if idle */
+	LoopTaskCb	f;
+	void		*opaque;
+};
+
 int		loop_init(LoopDrvType);
 int		loop_fd_add(Fd, LoopEvent, LoopEventCb, void *);
 int		loop_fd_change(Fd, LoopEvent);
 int		loop_fd_del(Fd);
+int		loop_fd_close(Fd);
 LoopEvent	loop_fd_events(Fd);
+void		loop_timer_init(LoopTimer *, LoopTimerCb, void *);
+void		loop_timer_set(LoopTimer *, int msec);
+void		loop_timer_cancel(LoopTimer *);
+int		loop_timer_active(const LoopTimer *);
+void		loop_task_init(LoopTask *, LoopTaskCb, void *);
+void		loop_defer(LoopTask *);
+void		loop_task_cancel(LoopTask *);
+int		loop_task_pending(const LoopTask *);
 void		loop_run(void);
 void		loop_quit(void);
 void		loop_fini(void);
@@ -0,0 +1,63 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <err.h>
+
+#include "proto.h"
+#include "source.h"
+
+/* Convert "msec temp brgth" lines of stdin to a trace file: mktrace path */
+
+int main(int argc, char *argv[])
+{
+	uint8_t rec[TRACE_HDR_SIZE > TRACE_REC_SIZE ?
+			TRACE_HDR_SIZE : TRACE_REC_SIZE] = { 0 };
+	unsigned long msec, last = 0;
+	unsigned temp, brgth;
+	uint32_t count = 0;
+	FILE *f;
+
+	if (argc != 2) {
+		fprintf(stderr, "usage: mktrace path < trace.txt\n");
+		return EXIT_FAILURE;
+	}
+
+	f = fopen(argv[1], "wb");
+	if (f == NULL) {
+		err(EXIT_FAILURE, "fopen(%s)", argv[1]);
+	}
+
+	/* The header is rewritten with the count at the end. */
+	if (fwrite(rec, TRACE_HDR_SIZE, 1, f) != 1) {
+		err(EXIT_FAILURE, "fwrite()");
+	}
+
+	while (scanf("%lu %u %u", &msec, &temp, &brgth) == 3) {
+		if (msec < last || msec >= UINT32_MAX ||
+		    temp > UINT16_MAX || brgth > UINT16_MAX) {
+			errx(EXIT_FAILURE, "line %u: bad record", count + 1);
+		}
+		last = msec;
+		put_le32(rec, msec);
+		put_le16(rec + 4, temp);
+		put_le16(rec + 6, brgth);
+		if (fwrite(rec, TRACE_REC_SIZE, 1, f) != 1) {
+			err(EXIT_FAILURE, "fwrite()");
+		}
+		count++;
+	}
+
+	if (!feof(stdin)) {
+		errx(EXIT_FAILURE, "line %u: parse error", count + 1);
+	}
+
+	put_le32(rec, TRACE_MAGIC);
+	put_le32(rec + 4, TRACE_VERSION);
+	put_le32(rec + 8, count);
+	put_le32(rec + 12, 0);
+	if (fseek(f, 0, SEEK_SET) < 0 ||
+	    fwrite(rec, TRACE_HDR_SIZE, 1, f) != 1 || fclose(f) != 0) {
+		err(EXIT_FAILURE, "%s", argv[1]);
+	}
+
+	return EXIT_SUCCESS;
+}
@@ -0,0 +1,26 @@
+#ifndef PROBES_H
+#define PROBES_H
+
+/*
+ * USDT probes of the "telco" provider. Built with HAVE_SDT=1 a probe is a
+ * single nop plus an ELF note, bpftrace or perf patch it when attached, so
+ * a disabled probe costs nothing but loading its arguments. Without
+ * HAVE_SDT the probes are compiled out. See probes/ for the probe list and
+ * example scripts.
+ */
+#ifdef HAVE_SDT
+#  include <sys/sdt.h>
+#  define PROBE0(name)			DTRACE_PROBE(telco, name)
+#  define PROBE1(name, a)		DTRACE_PROBE1(telco, name, a)
+#  define PROBE2(name, a, b)		DTRACE_PROBE2(telco, name, a, b)
+#  define PROBE3(name, a, b, c)		DTRACE_PROBE3(telco, name, a, b, c)
+#  define PROBE4(name, a, b, c, d)	DTRACE_PROBE4(telco, name, a, b, c, d)
+#else
+#  define PROBE0(name)			do { } while (0)
+#  define PROBE1(name, a)		do { } while (0)
+#  define PROBE2(name, a, b)		do { } while (0)
+#  define PROBE3(name, a, b, c)		do { } while (0)
+#  define PROBE4(name, a, b, c, d)	do { } while (0)
+#endif
+
+#endif
@@ -11,20 +11,130 @@
 #include "loop.h"
 #include "utils.h"
 #include "proctitle.h"
+#include "proto.h"
+#include "transport.h"
+#include "discovery.h"
 #include "device.h"
 #include "sigs.h"
 
 static Device device;
 
-static void env_opts_parse(int *host, int *iscontroller)
+static void env_opts_parse(DeviceConf *conf)
 {
+	device_conf_default(conf);
+
 	char *s = getenv("HOST_ADDR");
-	if (s == NULL || (*host = atoi(s)) < 0 || *host > DEVICE_HOST_ADDR_MAX) {
+	if (s == NULL || (conf->host = atoi(s)) < 0 ||
+			conf->host > DEVICE_HOST_ADDR_MAX) {
 		errx(EXIT_FAILURE, "provide HOST_ADDR variable [0, %d]",
 							DEVICE_HOST_ADDR_MAX);
 	}
 
-	*iscontroller = getenv("CONTROLLER") ? 1 : 0;
+	conf->iscontroller = getenv("CONTROLLER") ? 1 : 0;
+
+	s = getenv("FANOUT_MAX");
+	if (s != NULL && ((conf->fanout_max = atoi(s)) < DEVICE_FANOUT_MIN ||
+			conf->fanout_max > DEVICE_FANOUT_MAX)) {
+		errx(EXIT_FAILURE, "FANOUT_MAX must be in [%d, %d]",
+				DEVICE_FANOUT_MIN, DEVICE_FANOUT_MAX);
+	}
+
+	conf->stagger = getenv("POLL_STAGGER") ? 1 : 0;
+
+	s = getenv("TRANSPORT");
+	if (s != NULL && (conf->transport = transport_find(s)) == NULL) {
+		errx(EXIT_FAILURE, "unknown TRANSPORT \"%s\"", s);
+	}
+
+	const char *base = getenv("TCP_BASE");
+	s = getenv("TCP_PORT");
+	if (transport_tcp_setup(base ? base : TRANSPORT_TCP_BASE,
+				s ? atoi(s) : TRANSPORT_TCP_PORT,
+				getenv("TRANSPORT_MAP")) < 0) {
+		errx(EXIT_FAILURE, "invalid TCP_BASE, TCP_PORT or TRANSPORT_MAP");
+	}
+
+	s = getenv("POLL_ADAPT");
+	if (s != NULL && (sscanf(s, "%d:%d", &conf->poll_min,
+				&conf->poll_max) != 2 ||
+			conf->poll_min < DEVICE_POLL_MIN ||
+			conf->poll_min > conf->poll_max ||
+			conf->poll_max > DEVICE_MASTER_TIMEOUT)) {
+		errx(EXIT_FAILURE, "POLL_ADAPT must be min:max in [%d, %d]",
+				DEVICE_POLL_MIN, DEVICE_MASTER_TIMEOUT);
+	}
+
+	s = getenv("DISCOVERY");
+	if (s != NULL) {
+		conf->discovery = *s ? s : DISCOVERY_DEFAULT;
+	}
+
+	s = getenv("SHM");
+	if (s != NULL) {
+		conf->shm = *s ? s : SHM_DEFAULT;
+	}
+
+	s = getenv("STATUS");
+	if (s != NULL) {
+		conf->status = *s ? s : STATUS_DEFAULT;
+	}
+
+	s = getenv("SNAPSHOT");
+	if (s != NULL) {
+		conf->snapshot = *s ? s : SNAPSHOT_DEFAULT;
+	}
+
+	conf->source = getenv("SOURCE");
+
+	s = getenv("CAPTURE");
+	if (s != NULL) {
+		conf->capture = *s ? s : CAPTURE_DEFAULT;
+	}
+
+	s = getenv("DISPLAY_TICK");
+	if (s != NULL && (conf->display_tick = atoi(s)) < 0) {
+		errx(EXIT_FAILURE, "DISPLAY_TICK must be >= 0");
+	}
+
+	s = getenv("PEER_TIMEOUT");
+	if (s != NULL && (conf->peer_timeout = atoi(s)) <= 0) {
+		errx(EXIT_FAILURE, "PEER_TIMEOUT must be > 0");
+	}
+
+	conf->carry = getenv("POLL_CARRY") ? 1 : 0;
+	conf->watch = getenv("WATCH") ? 1 : 0;
+
+	s = getenv("SAMPLE");
+	if (s != NULL && ((conf->sample = atoi(s)) < 1 ||
+			conf->sample > DEVICE_SAMPLE_MAX)) {
+		errx(EXIT_FAILURE, "SAMPLE must be in [1, %d]",
+				DEVICE_SAMPLE_MAX);
+	}
+
+	s = getenv("SUBSCRIBE");
+	if (s != NULL && (sscanf(s, "%d:%d", &conf->sub_deadband,
+				&conf->sub_heartbeat) < 1 ||
+			conf->sub_deadband < 0 || conf->sub_deadband > 0xffff ||
+			conf->sub_heartbeat < DEVICE_SUB_SAMPLE ||
+			conf->sub_heartbeat > DEVICE_SUB_HEARTBEAT_MAX)) {
+		errx(EXIT_FAILURE, "SUBSCRIBE must be deadband[:heartbeat], "
+				"heartbeat in [%d, %d]", DEVICE_SUB_SAMPLE,
+				DEVICE_SUB_HEARTBEAT_MAX);
+	}
+
+	s = getenv("PROTO_VERSION");
+	if (s != NULL && ((conf->proto_max = atoi(s)) < PROTO_V1 ||
+			conf->proto_max > PROTO_VERSION)) {
+		errx(EXIT_FAILURE, "PROTO_VERSION must be in [%d, %d]",
+				PROTO_V1, PROTO_VERSION);
+	}
+
+	s = getenv("PROTO_BATCH");
+	if (s != NULL && ((conf->batch = atoi(s)) < 1 ||
+			conf->batch > PROTO_BATCH_MAX)) {
+		errx(EXIT_FAILURE, "PROTO_BATCH must be in [1, %d]",
+				PROTO_BATCH_MAX);
+	}
 }
 
 static void signals_notify(sigset_t *sigmask)
@@ -85,9 +195,9 @@ static void prog_deinit()
 
 int main(int argc, char *argv[], char *envp[])
 {
-	int host, iscontroller;
+	DeviceConf conf;
 
-	env_opts_parse(&host, &iscontroller);
+	env_opts_parse(&conf);
 
 	prog_init(argc, argv, envp);
 
@@ -95,7 +205,7 @@ int main(int argc, char *argv[], char *envp[])
 		display, timer
 	};
 
-	if (device_init(&device, host, iscontroller, &ops) < 0) {
+	if (device_init(&device, &conf, &ops) < 0) {
 		errx(EXIT_FAILURE, "device_init() failed");
 	}
 
@@ -0,0 +1,76 @@
+#include "proto.h"
+
+const TlvSchema proto_get_schema = {
+	MSG_GET, TLV_HDR_SIZE, UINT16_MAX, 1, 2, {
+		{ PARAM_TEXT,	TLV_STR },
+		{ PARAM_BRGHT,	TLV_U16 },
+	}
+};
+
+const TlvSchema proto_res_schema = {
+	MSG_RES, 9, 9, 0, 2, {
+		{ PARAM_TEMP,	TLV_U16 },
+		{ PARAM_BRGHT,	TLV_U16 },
+	}
+};
+
+uint16_t proto_csum(const uint8_t *p, size_t n)
+{
+	unsigned a = 0, b = 0;
+	size_t i;
+
+	for (i = 0; i < n; i++) {
+		a = (a + p[i]) % 255;
+		b = (b + a) % 255;
+	}
+
+	return (b << 8) | a;
+}
+
+uint8_t *proto_frame_begin(uint8_t *buf, uint8_t type, uint32_t id)
+{
+	buf[0] = type;
+	buf[1] = PROTO_V2;
+	put_le16(buf + 2, 0);
+	put_le32(buf + 4, id);
+	return buf + PROTO_HDR_SIZE;
+}
+
+size_t proto_frame_end(uint8_t *buf, size_t payload)
+{
+	size_t len = PROTO_HDR_SIZE + payload + PROTO_CSUM_SIZE;
+
+	put_le16(buf + 2, len);
+	put_le16(buf + len - PROTO_CSUM_SIZE,
+			proto_csum(buf, len - PROTO_CSUM_SIZE));
+	return len;
+}
+
+int proto_frame_check(const uint8_t *buf, size_t n, size_t size, ProtoHdr *h)
+{
+	/* Partial read. */
+	if (n < PROTO_HDR_SIZE) {
+		return 1;
+	}
+
+	h->type = buf[0];
+	h->ver  = buf[1];
+	h->len  = get_le16(buf + 2);
+	h->id   = get_le32(buf + 4);
+
+	if (h->ver != PROTO_V2 || h->len < PROTO_FRAME_MIN || h->len > size) {
+		return -1;
+	}
+
+	/* Partial read. */
+	if (n < h->len) {
+		return 1;
+	}
+
+	if (get_le16(buf + h->len - PROTO_CSUM_SIZE) !=
+			proto_csum(buf, h->len - PROTO_CSUM_SIZE)) {
+		return -1;
+	}
+
+	return 0;
+}
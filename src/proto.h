@@ -0,0 +1,138 @@
+#ifndef PROTO_H
+#define PROTO_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include "tlv.h"
+
+/* v1 is the original TLV protocol, v2 is the framed one. */
+#define PROTO_V1		1
+#define PROTO_V2		2
+#define PROTO_VERSION		PROTO_V2
+
+/* v1 messages, HELLO is a single byte, GET and RES are TLV encoded. */
+#define MSG_HELLO		1
+#define MSG_GET			2
+#define MSG_RES			3
+
+#define	PARAM_TEXT		1	/* nul-terminated */
+#define PARAM_TEMP		2	/* 2 bytes */
+#define PARAM_BRGHT		3	/* 2 bytes */
+
+/* Field indexes in v1 schemas, GET is either empty or has both fields. */
+#define GET_TEXT		0
+#define GET_BRGHT		1
+#define RES_TEMP		0
+#define RES_BRGHT		1
+
+extern const TlvSchema proto_get_schema;
+extern const TlvSchema proto_res_schema;
+
+/*
+ * v2 frame, all fields are little-endian:
+ *
+ *   u8 type | u8 ver | u16 len | u32 id | payload | u16 csum
+ *
+ * len is the whole frame length, id is echoed in the response to match
+ * pipelined requests, csum is Fletcher-16 over the frame without csum.
+ */
+#define PROTO_HDR_SIZE		8
+#define PROTO_CSUM_SIZE		2
+#define PROTO_FRAME_MIN		(PROTO_HDR_SIZE + PROTO_CSUM_SIZE)
+
+/* v2 types don't intersect with v1 ones, v1 nodes drop them. */
+#define MSG2_HELLO		0x11	/* u8 max version */
+#define MSG2_GET		0x12	/* see below */
+#define MSG2_RES		0x13	/* u8 count | u8 flags | count * reading */
+#define MSG2_SUB		0x14	/* u16 deadband | u16 heartbeat */
+#define MSG2_PUSH		0x15	/* u16 temp | u16 brgth | u32 epoch */
+
+/*
+ * GET payload: u8 flags | u8 count | u16 brgth | u32 epoch | u8 tlen | text
+ *
+ * epoch identifies the text and brightness of the sender session, when
+ * they were already delivered to the receiver the text is omitted and the
+ * UNCHANGED flag is set instead.
+ */
+#define GET2_FIXED_SIZE		9
+#define GET2_F_BRGHT		0x01
+#define GET2_F_TEXT		0x02
+#define GET2_F_UNCHANGED	0x04
+#define GET2_F_SUMMARY		0x08
+
+/* RES flags: STALE - the receiver doesn't have the text of the epoch,
+ * SUMMARY - the single reading is a summary of samples, see below. */
+#define RES2_F_STALE		0x01
+#define RES2_F_SUMMARY		0x02
+
+/* RES reading: u16 temp | u16 brgth */
+#define RES2_FIXED_SIZE		2
+#define RES2_READING_SIZE	4
+/* Max readings in a single RES. */
+#define PROTO_BATCH_MAX		16
+
+/*
+ * A sensor which samples its source replies to GET with the SUMMARY flag
+ * by a summary of the samples taken since the previous RES:
+ *
+ *   u16 count | u16 temp mean | min | max | last | u16 brgth mean | min |
+ *   max | last
+ */
+#define RES2_SUMMARY_SIZE	18
+
+/*
+ * A master subscribes a polled sensor with SUB on the same v2 connection.
+ * The sensor pushes its reading when it leaves the deadband around the last
+ * pushed one or when heartbeat msec passed since the last push, epoch is
+ * the one of the shown text. The master sends GET on the connection when
+ * its text changes and once per heartbeat, they aren't replied with RES,
+ * a PUSH follows when the text is new or stale.
+ */
+#define SUB2_SIZE		4
+#define PUSH2_SIZE		8
+
+typedef struct ProtoHdr ProtoHdr;
+
+struct ProtoHdr {
+	uint8_t		type;
+	uint8_t		ver;
+	uint16_t	len;
+	uint32_t	id;
+};
+
+static inline uint16_t get_le16(const uint8_t *p)
+{
+	return p[0] | (p[1] << 8);
+}
+
+static inline void put_le16(uint8_t *p, uint16_t n)
+{
+	p[0] = n        & 0xff;
+	p[1] = (n >> 8) & 0xff;
+}
+
+static inline uint32_t get_le32(const uint8_t *p)
+{
+	return get_le16(p) | ((uint32_t)get_le16(p + 2) << 16);
+}
+
+static inline void put_le32(uint8_t *p, uint32_t n)
+{
+	put_le16(p, n & 0xffff);
+	put_le16(p + 2, n >> 16);
+}
+
+uint16_t proto_csum(const uint8_t *p, size_t n);
+
+/* Write the header and return the payload pointer. */
+uint8_t *proto_frame_begin(uint8_t *buf, uint8_t type, uint32_t id);
+
+/* Set the length and checksum, return the frame length. */
+size_t proto_frame_end(uint8_t *buf, size_t payload);
+
+/* Check n received bytes: 1 - partial, 0 - complete frame, -1 - error.
+ * Bytes after the first frame are allowed, they belong to next frames. */
+int proto_frame_check(const uint8_t *buf, size_t n, size_t size, ProtoHdr *h);
+
+#endif
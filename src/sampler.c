@@ -0,0 +1,45 @@
+#include "utils.h"
+#include "sampler.h"
+
+void sampler_put(Sampler *s, uint16_t temp, uint16_t brgth)
+{
+	uint32_t i = s->head++ % SAMPLER_RING;
+
+	s->temp[i] = temp;
+	s->brgth[i] = brgth;
+}
+
+int sampler_window(Sampler *s, SamplerWindow *w)
+{
+	uint32_t n = s->head - s->tail, i;
+	uint32_t ts = 0, bs = 0;
+
+	/* Older samples are overwritten already. */
+	n = n > SAMPLER_RING ? SAMPLER_RING : n;
+	s->tail = s->head;
+	if (!n) {
+		return 0;
+	}
+
+	w->temp_min = w->brgth_min = UINT16_MAX;
+	w->temp_max = w->brgth_max = 0;
+	for (i = s->head - n; i != s->head; i++) {
+		uint16_t t = s->temp[i % SAMPLER_RING];
+		uint16_t b = s->brgth[i % SAMPLER_RING];
+
+		ts += t;
+		bs += b;
+		w->temp_min = MIN(w->temp_min, t);
+		w->temp_max = MAX(w->temp_max, t);
+		w->brgth_min = MIN(w->brgth_min, b);
+		w->brgth_max = MAX(w->brgth_max, b);
+	}
+
+	i = (s->head - 1) % SAMPLER_RING;
+	w->count = n;
+	w->temp_mean = ts / n;
+	w->brgth_mean = bs / n;
+	w->temp_last = s->temp[i];
+	w->brgth_last = s->brgth[i];
+	return n;
+}
@@ -0,0 +1,41 @@
+#ifndef SAMPLER_H
+#define SAMPLER_H
+
+#include <stdint.h>
+
+/*
+ * A sensor samples its value source faster than it is polled. Samples are
+ * kept in a fixed ring, a poll takes the summary of the window of samples
+ * since the previous poll, the latest SAMPLER_RING of them at most.
+ */
+#define SAMPLER_RING		256
+
+typedef struct Sampler Sampler;
+typedef struct SamplerWindow SamplerWindow;
+
+struct Sampler {
+	uint32_t	head;		/* samples taken */
+	uint32_t	tail;		/* the first sample of the window */
+	uint16_t	temp[SAMPLER_RING];
+	uint16_t	brgth[SAMPLER_RING];
+};
+
+struct SamplerWindow {
+	uint16_t	count;
+	uint16_t	temp_mean;
+	uint16_t	temp_min;
+	uint16_t	temp_max;
+	uint16_t	temp_last;
+	uint16_t	brgth_mean;
+	uint16_t	brgth_min;
+	uint16_t	brgth_max;
+	uint16_t	brgth_last;
+};
+
+void sampler_put(Sampler *s, uint16_t temp, uint16_t brgth);
+
+/* Summarize the window and start the next one, returns the sample count,
+ * w is not filled when the window is empty. */
+int sampler_window(Sampler *s, SamplerWindow *w);
+
+#endif
@@ -0,0 +1,145 @@
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+
+#include "shm.h"
+
+#define SHM_TABLE_MAGIC		0x53434c54	/* "TLCS" */
+#define SHM_TABLE_VERSION	2
+
+void *shm_map(const char *path, size_t size, uint32_t magic,
+		uint32_t version)
+{
+	struct stat st;
+	void *base;
+	int fd;
+
+	fd = open(path, O_RDWR | O_CREAT, 0644);
+	if (fd < 0) {
+		return NULL;
+	}
+
+	/* The file grows zeroed, a concurrent ftruncate() is harmless. */
+	if (fstat(fd, &st) < 0 ||
+	    ((size_t)st.st_size < size && ftruncate(fd, size) < 0)) {
+		close(fd);
+		return NULL;
+	}
+
+	base = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+	close(fd);
+	if (base == MAP_FAILED) {
+		return NULL;
+	}
+
+	/* The first process stamps the region, magic goes last. */
+	ShmHdr *h = base;
+	uint32_t zero = 0;
+
+	if (!__atomic_load_n(&h->magic, __ATOMIC_ACQUIRE)) {
+		h->version = version;
+		h->size = size;
+		__atomic_compare_exchange_n(&h->magic, &zero, magic, 0,
+				__ATOMIC_RELEASE, __ATOMIC_RELAXED);
+	}
+
+	if (__atomic_load_n(&h->magic, __ATOMIC_ACQUIRE) != magic ||
+	    h->version != version || h->size != size) {
+		munmap(base, size);
+		errno = EPROTO;
+		return NULL;
+	}
+
+	return base;
+}
+
+const void *shm_attach(const char *path, size_t size, uint32_t magic,
+		uint32_t version)
+{
+	const ShmHdr *h;
+	struct stat st;
+	void *base;
+	int fd;
+
+	fd = open(path, O_RDONLY);
+	if (fd < 0) {
+		return NULL;
+	}
+
+	/* Pages beyond the end of file would fault on access. */
+	if (fstat(fd, &st) < 0 || (size_t)st.st_size < size) {
+		close(fd);
+		errno = EPROTO;
+		return NULL;
+	}
+
+	base = mmap(NULL, size, PROT_READ, MAP_SHARED, fd, 0);
+	close(fd);
+	if (base == MAP_FAILED) {
+		return NULL;
+	}
+
+	h = base;
+	if (__atomic_load_n(&h->magic, __ATOMIC_ACQUIRE) != magic ||
+	    h->version != version || h->size != size) {
+		munmap(base, size);
+		errno = EPROTO;
+		return NULL;
+	}
+
+	return base;
+}
+
+void shm_unmap(const void *base, size_t size)
+{
+	munmap((void *)base, size);
+}
+
+void shm_record_write(uint32_t *seq, void *dst, const void *src, size_t n)
+{
+	shm_write_begin(seq);
+	memcpy(dst, src, n);
+	shm_write_end(seq);
+}
+
+int shm_record_read(const uint32_t *seq, void *dst, const void *src,
+		size_t n)
+{
+	int i;
+
+	for (i = 0; i < SHM_READ_TRIES; i++) {
+		uint32_t s = shm_read_begin(seq);
+		memcpy(dst, src, n);
+		if (shm_read_end(seq, s)) {
+			return 1;
+		}
+	}
+
+	return 0;
+}
+
+ShmTable *shm_table_map(const char *path)
+{
+	return shm_map(path, sizeof(ShmTable), SHM_TABLE_MAGIC,
+			SHM_TABLE_VERSION);
+}
+
+void shm_table_unmap(ShmTable *t)
+{
+	shm_unmap(t, sizeof(*t));
+}
+
+void shm_slot_write(ShmSlot *s, const ShmData *d)
+{
+	shm_record_write(&s->seq, &s->d, d, sizeof(*d));
+}
+
+int shm_slot_read(const ShmSlot *s, ShmData *d)
+{
+	return shm_record_read(&s->seq, d, &s->d, sizeof(*d));
+}
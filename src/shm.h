@@ -0,0 +1,119 @@
+#ifndef SHM_H
+#define SHM_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+/*
+ * Shared regions are files mapped by every co-located process. A region
+ * starts with ShmHdr, the first process stamps it and the others check that
+ * the layout matches. Records inside are guarded by seqlocks: a writer makes
+ * seq odd while it updates a record, a reader copies the record and retries
+ * when seq was odd or has changed meanwhile. Each record has a single writer.
+ */
+typedef struct ShmHdr ShmHdr;
+
+struct ShmHdr {
+	uint32_t	magic;
+	uint32_t	version;
+	uint32_t	size;
+	uint32_t	pad;
+};
+
+/* Readers give up on a record which is rewritten all the time. */
+#define SHM_READ_TRIES		4
+
+/* seq is odd even if a previous writer died in the middle of a record. */
+static inline void shm_write_begin(uint32_t *seq)
+{
+	__atomic_store_n(seq, (*seq + 1) | 1, __ATOMIC_RELAXED);
+	__atomic_thread_fence(__ATOMIC_RELEASE);
+}
+
+static inline void shm_write_end(uint32_t *seq)
+{
+	__atomic_store_n(seq, *seq + 1, __ATOMIC_RELEASE);
+}
+
+static inline uint32_t shm_read_begin(const uint32_t *seq)
+{
+	return __atomic_load_n(seq, __ATOMIC_ACQUIRE);
+}
+
+/* 1 - the copy made since shm_read_begin() is consistent. */
+static inline int shm_read_end(const uint32_t *seq, uint32_t s)
+{
+	__atomic_thread_fence(__ATOMIC_ACQUIRE);
+	return !(s & 1) && __atomic_load_n(seq, __ATOMIC_RELAXED) == s;
+}
+
+/* Copy a record of n bytes guarded by seq. */
+void shm_record_write(uint32_t *seq, void *dst, const void *src, size_t n);
+
+/* 1 - dst holds a consistent copy, 0 - the record is being rewritten. */
+int shm_record_read(const uint32_t *seq, void *dst, const void *src,
+		size_t n);
+
+/* Map size bytes of the file path, it is created when missing. */
+void *shm_map(const char *path, size_t size, uint32_t magic,
+		uint32_t version);
+
+/* Map an existing region read only, the layout is checked. */
+const void *shm_attach(const char *path, size_t size, uint32_t magic,
+		uint32_t version);
+
+void shm_unmap(const void *base, size_t size);
+
+/*
+ * The sensor table shared by co-located nodes, a slot per address. Sensors
+ * publish readings in their slots, masters and controllers publish the
+ * broadcast message and the polled range and bump cycle when they read
+ * the table, so a sensor in the range sees it is polled without a socket
+ * round trip.
+ */
+#define SHM_DEFAULT		"telco.shm"
+#define SHM_SLOTS		256
+#define SHM_MSG_SIZE		64
+
+#define SHM_F_READING		0x01	/* temp and brgth are set */
+
+typedef struct ShmData ShmData;
+typedef struct ShmSlot ShmSlot;
+typedef struct ShmTable ShmTable;
+
+struct ShmData {
+	int64_t		stamp;		/* clock_msec() of the last publish */
+	uint32_t	cycle;		/* polling cycles of the writer */
+	uint32_t	msg_epoch;
+	uint16_t	temp;
+	uint16_t	brgth;
+	uint16_t	msg_brgth;
+	int16_t		poll_from;	/* the range polled by the writer */
+	int16_t		poll_to;
+	uint8_t		state;
+	uint8_t		flags;
+	uint8_t		msg_len;
+	char		msg[SHM_MSG_SIZE];
+};
+
+/* Slots don't share cache lines with neighbours. */
+struct ShmSlot {
+	uint32_t	seq;
+	ShmData		d;
+} __attribute__((aligned(128)));
+
+struct ShmTable {
+	ShmHdr		hdr;
+	ShmSlot		slots[SHM_SLOTS];
+};
+
+ShmTable *shm_table_map(const char *path);
+
+void shm_table_unmap(ShmTable *t);
+
+void shm_slot_write(ShmSlot *s, const ShmData *d);
+
+/* 1 - d is read, 0 - the slot is being rewritten. */
+int shm_slot_read(const ShmSlot *s, ShmData *d);
+
+#endif
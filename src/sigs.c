@@ -93,8 +93,7 @@ void sigs_reset(int signo)
 
 void sigs_deinit(void)
 {
-	loop_fd_del(sigpipe[0]);
-	close(sigpipe[0]);
+	loop_fd_close(sigpipe[0]);
 	close(sigpipe[1]);
 }
 
@@ -0,0 +1,33 @@
+#include <stdio.h>
+
+#include "shm.h"
+#include "snapshot.h"
+
+#define SNAPSHOT_MAGIC		0x4e434c54	/* "TLCN" */
+#define SNAPSHOT_VERSION	1
+
+Snapshot *snapshot_map(const char *prefix, int host)
+{
+	char path[256];
+
+	snprintf(path, sizeof(path), "%s.%d", prefix, host);
+	return shm_map(path, sizeof(Snapshot), SNAPSHOT_MAGIC,
+			SNAPSHOT_VERSION);
+}
+
+void snapshot_unmap(Snapshot *snap)
+{
+	shm_unmap(snap, sizeof(*snap));
+}
+
+void snapshot_write(Snapshot *snap, const SnapData *d)
+{
+	shm_record_write(&snap->seq, &snap->d, d, sizeof(*d));
+}
+
+int snapshot_read(const Snapshot *snap, SnapData *d)
+{
+	/* A single reader, an odd seq is left by a killed writer. */
+	return shm_record_read(&snap->seq, d, &snap->d, sizeof(*d)) &&
+		d->stamp ? 1 : 0;
+}
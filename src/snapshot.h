@@ -0,0 +1,52 @@
+#ifndef SNAPSHOT_H
+#define SNAPSHOT_H
+
+#include <stdint.h>
+
+#include "shm.h"
+
+/*
+ * A node keeps the state it needs to resume after a restart in a mapped
+ * file of its own, it is rewritten in place on every step and is guarded by
+ * a seqlock, so a node killed in the middle of a write leaves a snapshot
+ * which is rejected on startup.
+ */
+#define SNAPSHOT_DEFAULT	"telco.snap"
+#define SNAPSHOT_MSG_SIZE	64
+#define SNAPSHOT_MEMBER_WORDS	4
+
+typedef struct SnapData SnapData;
+typedef struct Snapshot Snapshot;
+
+struct SnapData {
+	int64_t		stamp;		/* wall clock msec of the write */
+	uint32_t	msg_epoch;
+	int32_t		interval;	/* polling interval in msec */
+	uint16_t	host;
+	uint16_t	avg_set;
+	uint16_t	avg_temp;
+	uint16_t	avg_brgth;
+	uint16_t	msg_brgth;
+	uint8_t		state;
+	uint8_t		msg_len;
+	char		msg[SNAPSHOT_MSG_SIZE];	/* sent or shown message */
+	uint64_t	members[SNAPSHOT_MEMBER_WORDS]; /* addresses replied */
+};
+
+struct Snapshot {
+	ShmHdr		hdr;
+	uint32_t	seq;
+	SnapData	d;
+};
+
+/* Map the snapshot of the host, prefix.host is created when missing. */
+Snapshot *snapshot_map(const char *prefix, int host);
+
+void snapshot_unmap(Snapshot *snap);
+
+void snapshot_write(Snapshot *snap, const SnapData *d);
+
+/* 1 - d is read, 0 - the snapshot is empty or torn. */
+int snapshot_read(const Snapshot *snap, SnapData *d);
+
+#endif
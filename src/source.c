@@ -0,0 +1,235 @@
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <time.h>
+#include <errno.h>
+
+#include "utils.h"
+#include "proto.h"
+#include "source.h"
+
+struct Source {
+	void		(*next)(Source *, uint16_t *, uint16_t *);
+	uint64_t	state;		/* rand */
+	const uint8_t	*map;		/* trace */
+	size_t		size;
+	uint32_t	count;
+	uint32_t	span;		/* trace duration in msec */
+	uint32_t	pos;		/* the current record */
+	double		speed;
+	int64_t		start;
+};
+
+/* Seeds of neighbour addresses are spread over the whole state. */
+static uint64_t splitmix64(uint64_t x)
+{
+	x += 0x9e3779b97f4a7c15ULL;
+	x = (x ^ (x >> 30)) * 0xbf58476d1ce4e5b9ULL;
+	x = (x ^ (x >> 27)) * 0x94d049bb133111ebULL;
+	return x ^ (x >> 31);
+}
+
+static uint32_t xorshift64s(uint64_t *s)
+{
+	uint64_t x = *s;
+
+	x ^= x >> 12;
+	x ^= x << 25;
+	x ^= x >> 27;
+	*s = x;
+	return (x * 0x2545f4914f6cdd1dULL) >> 32;
+}
+
+/* The ranges of the original generator. */
+static void source_rand_next(Source *s, uint16_t *temp, uint16_t *brgth)
+{
+#define GEN_XXX(s, e, r)	((s) + (r) % ((e) - (s)) + 1)
+	*temp  = GEN_XXX(10, 25, xorshift64s(&s->state));
+	*brgth = GEN_XXX(50, 70, xorshift64s(&s->state));
+#undef GEN_XXX
+}
+
+static uint32_t trace_msec(const Source *s, uint32_t i)
+{
+	return get_le32(s->map + TRACE_HDR_SIZE + i * TRACE_REC_SIZE);
+}
+
+/* Readings are sampled by the replay time, the cursor only moves forward
+ * until the trace wraps around. */
+static void source_trace_next(Source *s, uint16_t *temp, uint16_t *brgth)
+{
+	uint32_t t = (uint64_t)((clock_msec() - s->start) * s->speed) %
+			s->span;
+
+	if (t < trace_msec(s, s->pos)) {
+		s->pos = 0;
+	}
+	while (s->pos + 1 < s->count && trace_msec(s, s->pos + 1) <= t) {
+		s->pos++;
+	}
+
+	const uint8_t *r = s->map + TRACE_HDR_SIZE + s->pos * TRACE_REC_SIZE;
+	*temp  = get_le16(r + 4);
+	*brgth = get_le16(r + 6);
+}
+
+static int source_rand_open(Source *s, const char *arg, int host)
+{
+	uint64_t seed;
+
+	if (arg != NULL) {
+		char *end;
+		seed = strtoull(arg, &end, 0);
+		if (*end) {
+			return -1;
+		}
+	} else {
+		seed = (uint64_t)time(NULL) << 20 ^ getpid();
+	}
+
+	s->state = splitmix64(seed ^ (uint64_t)host << 56);
+	if (!s->state) {
+		s->state = 1;
+	}
+	s->next = source_rand_next;
+	return 0;
+}
+
+/* The header is read once the file is known to hold it. */
+static int trace_check(Source *s)
+{
+	uint32_t i;
+
+	if (s->size < TRACE_HDR_SIZE || get_le32(s->map) != TRACE_MAGIC ||
+	    get_le32(s->map + 4) != TRACE_VERSION) {
+		return -1;
+	}
+
+	s->count = get_le32(s->map + 8);
+
+	if (!s->count ||
+	    s->count > (s->size - TRACE_HDR_SIZE) / TRACE_REC_SIZE) {
+		return -1;
+	}
+
+	for (i = 1; i < s->count; i++) {
+		if (trace_msec(s, i) < trace_msec(s, i - 1)) {
+			return -1;
+		}
+	}
+
+	return trace_msec(s, s->count - 1) == UINT32_MAX ? -1 : 0;
+}
+
+static int source_trace_open(Source *s, const char *arg, int host)
+{
+	char path[256], *speed;
+	const char *d;
+	struct stat st;
+	void *map;
+	int fd;
+
+	if (arg == NULL) {
+		return -1;
+	}
+
+	/* The address is put instead of "%d". */
+	d = strstr(arg, "%d");
+	if (d != NULL) {
+		snprintf(path, sizeof(path), "%.*s%d%s",
+				(int)(d - arg), arg, host, d + 2);
+	} else {
+		snprintf(path, sizeof(path), "%s", arg);
+	}
+
+	/* Only a numeric suffix is the speed, paths might contain ':'. */
+	s->speed = 1;
+	speed = strrchr(path, ':');
+	if (speed != NULL && speed[1] &&
+	    strspn(speed + 1, "0123456789.") == strlen(speed + 1)) {
+		*speed++ = 0;
+		s->speed = atof(speed);
+		if (s->speed <= 0) {
+			return -1;
+		}
+	}
+
+	fd = open(path, O_RDONLY);
+	if (fd < 0) {
+		return -1;
+	}
+	if (fstat(fd, &st) < 0) {
+		close(fd);
+		return -1;
+	}
+
+	map = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+	close(fd);
+	if (map == MAP_FAILED) {
+		return -1;
+	}
+
+	s->map = map;
+	s->size = st.st_size;
+	if (trace_check(s) < 0) {
+		errno = EPROTO;
+		return -1;
+	}
+
+	madvise(map, st.st_size, MADV_SEQUENTIAL);
+	s->span = trace_msec(s, s->count - 1) + 1;
+	s->start = clock_msec();
+	s->next = source_trace_next;
+	return 0;
+}
+
+Source *source_open(const char *spec, int host)
+{
+	const char *arg = strchr(spec, ':');
+	size_t n = arg ? (size_t)(arg - spec) : strlen(spec);
+	Source *s;
+	int rc;
+
+	s = calloc(1, sizeof(*s));
+	if (s == NULL) {
+		return NULL;
+	}
+	errno = 0;
+
+	arg = arg ? arg + 1 : NULL;
+	if (n == 4 && !strncmp(spec, "rand", n)) {
+		rc = source_rand_open(s, arg, host);
+	} else if (n == 5 && !strncmp(spec, "trace", n)) {
+		rc = source_trace_open(s, arg, host);
+	} else {
+		rc = -1;
+	}
+
+	if (rc < 0) {
+		int e = errno;
+		source_close(s);
+		errno = e ? e : EINVAL;
+		return NULL;
+	}
+
+	return s;
+}
+
+void source_next(Source *s, uint16_t *temp, uint16_t *brgth)
+{
+	s->next(s, temp, brgth);
+}
+
+void source_close(Source *s)
+{
+	if (s->map != NULL) {
+		munmap((void *)s->map, s->size);
+	}
+	free(s);
+}
@@ -0,0 +1,34 @@
+#ifndef SOURCE_H
+#define SOURCE_H
+
+#include <stdint.h>
+
+/*
+ * A value source produces the readings a sensor reports:
+ *
+ *   rand[:seed]			xorshift generator of the device, the same
+ *				seed and address give the same sequence
+ *   trace:path[:speed]		replay of a recorded trace at speed times the
+ *				real time, "%d" in path is the address, a
+ *				suffix which is not a number is a part of path
+ *
+ * A trace file is u32 magic | u32 version | u32 count | u32 pad followed by
+ * count records u32 msec | u16 temp | u16 brgth, all little-endian with msec
+ * not decreasing. The replay restarts when the trace ends.
+ */
+#define SOURCE_DEFAULT		"rand"
+
+#define TRACE_MAGIC		0x52434c54	/* "TLCR" */
+#define TRACE_VERSION		1
+#define TRACE_HDR_SIZE		16
+#define TRACE_REC_SIZE		8
+
+typedef struct Source Source;
+
+Source *source_open(const char *spec, int host);
+
+void source_next(Source *s, uint16_t *temp, uint16_t *brgth);
+
+void source_close(Source *s);
+
+#endif
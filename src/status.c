@@ -0,0 +1,32 @@
+#include "shm.h"
+#include "status.h"
+
+#define STATUS_MAGIC		0x50434c54	/* "TLCP" */
+#define STATUS_VERSION		1
+
+StatusPage *status_map(const char *path)
+{
+	return shm_map(path, sizeof(StatusPage), STATUS_MAGIC,
+			STATUS_VERSION);
+}
+
+const StatusPage *status_attach(const char *path)
+{
+	return shm_attach(path, sizeof(StatusPage), STATUS_MAGIC,
+			STATUS_VERSION);
+}
+
+void status_unmap(const StatusPage *page)
+{
+	shm_unmap(page, sizeof(*page));
+}
+
+void status_slot_write(StatusSlot *s, const StatusData *d)
+{
+	shm_record_write(&s->seq, &s->d, d, sizeof(*d));
+}
+
+int status_slot_read(const StatusSlot *s, StatusData *d)
+{
+	return shm_record_read(&s->seq, d, &s->d, sizeof(*d));
+}
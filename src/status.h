@@ -0,0 +1,68 @@
+#ifndef STATUS_H
+#define STATUS_H
+
+#include <stdint.h>
+
+#include "shm.h"
+
+/*
+ * The status page is a mapped file with a seqlock guarded slot per address.
+ * Every node with STATUS set publishes its state, averages, shown message
+ * and counters in its slot, a monitor reads the whole fleet from one
+ * mapping. The layout is versioned by the region header.
+ */
+#define STATUS_DEFAULT		"telco.status"
+#define STATUS_SLOTS		256
+#define STATUS_NAME_SIZE	12
+#define STATUS_MSG_SIZE		64
+
+typedef struct StatusData StatusData;
+typedef struct StatusSlot StatusSlot;
+typedef struct StatusPage StatusPage;
+
+struct StatusData {
+	int64_t		stamp;		/* clock_msec() of the last publish */
+	int32_t		pid;
+	uint16_t	host;
+	uint16_t	avg_set;	/* averages are calculated */
+	uint16_t	avg_temp;
+	uint16_t	avg_brgth;
+	uint16_t	msg_brgth;	/* brightness of the message */
+	uint16_t	msg_len;
+	uint32_t	msg_epoch;
+	uint32_t	cycles;
+	uint32_t	overruns;
+	uint32_t	congestions;
+	uint32_t	msg_suppressed;
+	int32_t		interval;
+	int32_t		window;
+	int32_t		cycle_cost;
+	int32_t		latency;
+	char		state[STATUS_NAME_SIZE];
+	char		transport[STATUS_NAME_SIZE];
+	char		msg[STATUS_MSG_SIZE];	/* sent or shown message */
+};
+
+struct StatusSlot {
+	uint32_t	seq;
+	StatusData	d;
+} __attribute__((aligned(64)));
+
+struct StatusPage {
+	ShmHdr		hdr;
+	StatusSlot	slots[STATUS_SLOTS];
+};
+
+StatusPage *status_map(const char *path);
+
+/* Read only mapping for monitors. */
+const StatusPage *status_attach(const char *path);
+
+void status_unmap(const StatusPage *page);
+
+void status_slot_write(StatusSlot *s, const StatusData *d);
+
+/* 1 - d is read, 0 - the slot is being rewritten. */
+int status_slot_read(const StatusSlot *s, StatusData *d);
+
+#endif
@@ -0,0 +1,88 @@
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+
+#include <unistd.h>
+#include <errno.h>
+
+#include "utils.h"
+#include "tcp.h"
+
+/* Requests and replies are small, don't wait to coalesce them. */
+static int tcp_nodelay(int tcp)
+{
+	int on = 1;
+	return setsockopt(tcp, IPPROTO_TCP, TCP_NODELAY, &on, sizeof(on));
+}
+
+int tcp_listen(const struct sockaddr_in *sin)
+{
+	int tcp, rc, on = 1;
+
+	tcp = socket(AF_INET, SOCK_STREAM, 0);
+	if (tcp < 0)
+		return -1;
+
+	/* A restarted sensor binds while old connections are in TIME_WAIT. */
+	rc = setsockopt(tcp, SOL_SOCKET, SO_REUSEADDR, &on, sizeof(on));
+	if (rc < 0) {
+		close(tcp);
+		return -1;
+	}
+
+	rc = bind(tcp, (void *)sin, sizeof(*sin));
+	if (rc < 0) {
+		close(tcp);
+		return -1;
+	}
+
+	rc = listen(tcp, SOMAXCONN);
+	if (rc < 0) {
+		close(tcp);
+		return -1;
+	}
+
+	return tcp;
+}
+
+int tcp_accept(int tcp, int nonblock)
+{
+	struct sockaddr_storage ss;
+	socklen_t slen = sizeof(ss);
+
+	int afd = accept(tcp, (void *)&ss, &slen);
+	if (afd < 0) {
+		return afd;
+	}
+
+	if ((nonblock && fd_nonblock(afd) < 0) || tcp_nodelay(afd) < 0) {
+		close(afd);
+		return -1;
+	}
+
+	return afd;
+}
+
+int tcp_connect(const struct sockaddr_in *sin, int nonblock)
+{
+	int tcp, rc;
+
+	tcp = socket(AF_INET, SOCK_STREAM, 0);
+	if (tcp < 0)
+		return -1;
+
+	if ((nonblock && fd_nonblock(tcp) < 0) || tcp_nodelay(tcp) < 0) {
+		close(tcp);
+		return -1;
+	}
+
+	rc = connect(tcp, (void *)sin, sizeof(*sin));
+	if (rc < 0) {
+		if (!nonblock || (nonblock && errno != EINPROGRESS)) {
+			close(tcp);
+			return -1;
+		}
+	}
+
+	return tcp;
+}
@@ -0,0 +1,10 @@
+#ifndef TCP_H
+#define TCP_H
+
+#include <netinet/in.h>
+
+int tcp_listen(const struct sockaddr_in *sin);
+int tcp_accept(int tcp, int nonblock);
+int tcp_connect(const struct sockaddr_in *sin, int nonblock);
+
+#endif
@@ -0,0 +1,89 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <err.h>
+
+#include "utils.h"
+#include "status.h"
+
+/* Dump the status page of all nodes: telstat [-a] [path] */
+
+static void usage(void)
+{
+	fprintf(stderr, "usage: telstat [-a] [path]\n"
+			"  -a  show empty and busy slots\n");
+	exit(EXIT_FAILURE);
+}
+
+int main(int argc, char *argv[])
+{
+	const char *path = STATUS_DEFAULT;
+	const StatusPage *page;
+	int all = 0, i, c;
+
+	while ((c = getopt(argc, argv, "a")) != -1) {
+		switch (c) {
+		case 'a':
+			all = 1;
+			break;
+		default:
+			usage();
+		}
+	}
+
+	if (optind < argc) {
+		path = argv[optind++];
+	}
+	if (optind < argc) {
+		usage();
+	}
+
+	page = status_attach(path);
+	if (page == NULL) {
+		err(EXIT_FAILURE, "status_attach(%s)", path);
+	}
+
+	int64_t now = clock_msec();
+
+	printf("%4s %-10s %7s %7s %5s %5s %6s %6s %4s %5s %4s %-5s %8s %s\n",
+		"ADDR", "STATE", "PID", "AGE", "TEMP", "BRGTH", "CYCLES",
+		"OVERR", "WND", "POLL", "COST", "TR", "EPOCH", "MESSAGE");
+
+	for (i = 0; i < STATUS_SLOTS; i++) {
+		StatusData d;
+
+		if (!status_slot_read(&page->slots[i], &d)) {
+			if (all) {
+				printf("%4d %-10s\n", i, "BUSY");
+			}
+			continue;
+		}
+		if (!d.stamp) {
+			if (all) {
+				printf("%4d %-10s\n", i, "-");
+			}
+			continue;
+		}
+
+		d.state[sizeof(d.state) - 1] = 0;
+		d.transport[sizeof(d.transport) - 1] = 0;
+		if (d.msg_len >= sizeof(d.msg)) {
+			d.msg_len = sizeof(d.msg) - 1;
+		}
+		d.msg[d.msg_len] = 0;
+
+		printf("%4u %-10s %7d %7lld ", d.host, d.state, d.pid,
+				(long long)(now - d.stamp));
+		if (d.avg_set) {
+			printf("%5u %5u ", d.avg_temp, d.avg_brgth);
+		} else {
+			printf("%5s %5s ", "-", "-");
+		}
+		printf("%6u %6u %4d %5d %4d %-5s %08x \"%s\"\n",
+				d.cycles, d.overruns, d.window, d.interval,
+				d.cycle_cost, d.transport, d.msg_epoch, d.msg);
+	}
+
+	status_unmap(page);
+	return EXIT_SUCCESS;
+}
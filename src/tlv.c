@@ -0,0 +1,174 @@
+#include <string.h>
+
+#include "tlv.h"
+
+static uint16_t get_u16(const uint8_t *p)
+{
+	return (p[0] << 8) | p[1];
+}
+
+static void put_u16(uint8_t *p, uint16_t n)
+{
+	p[0] = (n >> 8) & 0xff;
+	p[1] = n        & 0xff;
+}
+
+static int tlv_field_find(const TlvSchema *schema, uint8_t type)
+{
+	int i;
+
+	for (i = 0; i < schema->nfields; i++) {
+		if (schema->fields[i].type == type) {
+			return i;
+		}
+	}
+
+	return -1;
+}
+
+void tlv_decoder_init(TlvDecoder *dec, const TlvSchema *schema)
+{
+	memset(dec, 0, sizeof(*dec));
+	dec->schema = schema;
+	dec->field = -1;
+}
+
+static int tlv_decode_done(TlvDecoder *dec)
+{
+	const TlvSchema *schema = dec->schema;
+	int i;
+
+	if (schema->empty && dec->len == TLV_HDR_SIZE) {
+		return 0;
+	}
+
+	for (i = 0; i < schema->nfields; i++) {
+		if (!dec->vals[i].set) {
+			return -1;
+		}
+	}
+
+	return 0;
+}
+
+int tlv_decode(TlvDecoder *dec, const uint8_t *buf, size_t n, size_t size)
+{
+	const TlvSchema *schema = dec->schema;
+
+	if (!dec->len) {
+		/* Partial read. */
+		if (n < TLV_HDR_SIZE) {
+			return n && buf[0] != schema->msg ? -1 : 1;
+		}
+
+		dec->len = get_u16(buf + 1);
+		if (buf[0] != schema->msg || dec->len > size ||
+		    dec->len < schema->len_min || dec->len > schema->len_max) {
+			return -1;
+		}
+		dec->pos = TLV_HDR_SIZE;
+	}
+
+	/* Read more bytes than the message reports. */
+	if (n > dec->len) {
+		return -1;
+	}
+
+	while (dec->pos < n) {
+		if (dec->field == -1) {
+			int i = tlv_field_find(schema, buf[dec->pos]);
+			/* Unknown or duplicated param. */
+			if (i < 0 || dec->vals[i].set) {
+				return -1;
+			}
+			dec->field = i;
+			dec->vpos = ++dec->pos;
+			continue;
+		}
+
+		TlvValue *v = &dec->vals[dec->field];
+		const uint8_t *s;
+
+		switch (schema->fields[dec->field].kind) {
+		case TLV_U16:
+			if (dec->vpos + 2 > dec->len) {
+				return -1;
+			}
+			/* Partial read. */
+			if (dec->vpos + 2 > n) {
+				return 1;
+			}
+			v->u16 = get_u16(buf + dec->vpos);
+			dec->pos = dec->vpos + 2;
+			break;
+		case TLV_STR:
+			/* Scan only new bytes. */
+			s = memchr(buf + dec->pos, 0, n - dec->pos);
+			if (s == NULL) {
+				dec->pos = n;
+				return n == dec->len ? -1 : 1;
+			}
+			v->str = (const char *)buf + dec->vpos;
+			v->len = s - (buf + dec->vpos);
+			dec->pos = s - buf + 1;
+			break;
+		}
+
+		v->set = 1;
+		dec->field = -1;
+	}
+
+	/* Partial read. */
+	if (dec->pos < dec->len) {
+		return 1;
+	}
+
+	return dec->field == -1 ? tlv_decode_done(dec) : -1;
+}
+
+size_t tlv_encode(const TlvSchema *schema, uint8_t *buf, size_t size,
+			const TlvValue *vals)
+{
+	size_t len = TLV_HDR_SIZE, fixed = TLV_HDR_SIZE, avail, n;
+	int i;
+
+	/* Type bytes, u16 values and string terminators always fit,
+	 * strings share the rest of the buffer. */
+	for (i = 0; i < schema->nfields; i++) {
+		if (vals[i].set) {
+			fixed += schema->fields[i].kind == TLV_U16 ? 3 : 2;
+		}
+	}
+	if (fixed > size) {
+		return 0;
+	}
+	avail = size - fixed;
+
+	buf[0] = schema->msg;
+	for (i = 0; i < schema->nfields; i++) {
+		const TlvValue *v = &vals[i];
+		uint8_t *q = buf + len;
+
+		if (!v->set) {
+			continue;
+		}
+
+		*q++ = schema->fields[i].type;
+		switch (schema->fields[i].kind) {
+		case TLV_U16:
+			put_u16(q, v->u16);
+			len += 3;
+			break;
+		case TLV_STR:
+			n = v->len > avail ? avail : v->len;
+			avail -= n;
+			memcpy(q, v->str, n);
+			q[n] = 0;	/* make sure it is nullterminated */
+			len += n + 2;
+			break;
+		}
+	}
+
+	put_u16(buf + 1, len);
+	return len;
+}
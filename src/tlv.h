@@ -0,0 +1,68 @@
+#ifndef TLV_H
+#define TLV_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+/*
+ * v1 message: u8 msg | u16 len (big-endian, whole message) | params
+ * param:      u8 type | value
+ *
+ * A schema lists params of a message type, the decoder keeps its position
+ * between partial reads so every byte is parsed once.
+ */
+#define TLV_HDR_SIZE		3
+#define TLV_FIELDS_MAX		4
+
+typedef enum {
+	TLV_U16,		/* 2 bytes big-endian */
+	TLV_STR,		/* nul-terminated */
+} TlvKind;
+
+typedef struct TlvField TlvField;
+typedef struct TlvSchema TlvSchema;
+typedef struct TlvValue TlvValue;
+typedef struct TlvDecoder TlvDecoder;
+
+struct TlvField {
+	uint8_t		type;
+	TlvKind		kind;
+};
+
+struct TlvSchema {
+	uint8_t		msg;
+	uint16_t	len_min;	/* without params if empty is allowed */
+	uint16_t	len_max;
+	int		empty;		/* message without params is allowed */
+	int		nfields;	/* all fields are required */
+	TlvField	fields[TLV_FIELDS_MAX];
+};
+
+struct TlvValue {
+	int		set;
+	uint16_t	u16;
+	const char	*str;		/* points into the decoded buffer */
+	size_t		len;		/* str length without 0 */
+};
+
+struct TlvDecoder {
+	const TlvSchema	*schema;
+	size_t		pos;		/* parsed bytes */
+	size_t		vpos;		/* value start of the current field */
+	uint16_t	len;		/* message length, 0 if unknown */
+	int		field;		/* current field or -1 for type */
+	TlvValue	vals[TLV_FIELDS_MAX];
+};
+
+void tlv_decoder_init(TlvDecoder *dec, const TlvSchema *schema);
+
+/* Continue decoding of n bytes accumulated in buf of size bytes:
+ * 1 - partial, 0 - complete message, -1 - error. */
+int tlv_decode(TlvDecoder *dec, const uint8_t *buf, size_t n, size_t size);
+
+/* Encode fields which are set in vals, strings are truncated to fit.
+ * Return the message length. */
+size_t tlv_encode(const TlvSchema *schema, uint8_t *buf, size_t size,
+			const TlvValue *vals);
+
+#endif
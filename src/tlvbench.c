@@ -0,0 +1,123 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <time.h>
+
+#include "tlv.h"
+#include "proto.h"
+
+/* Time the v1 codec over GET and RES: tlvbench [-n iterations] */
+
+#define BENCH_BUF_SIZE		128
+
+static void usage(void)
+{
+	fprintf(stderr, "usage: tlvbench [-n iterations]\n");
+	exit(EXIT_FAILURE);
+}
+
+static int64_t clock_nsec(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (int64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+static void report(const char *name, long n, int64_t nsec, unsigned sum)
+{
+	printf("%-12s %10ld ops %8.1f ns/op %8.2f Mops/s (%u)\n", name, n,
+			(double)nsec / n, n * 1e3 / (nsec ? nsec : 1), sum);
+}
+
+/* A chunk is decoded at once, the way a whole message is received. */
+static unsigned bench_decode(const TlvSchema *schema, const uint8_t *buf,
+				size_t len, long n, int chunk)
+{
+	TlvDecoder dec;
+	unsigned sum = 0;
+	long i;
+
+	for (i = 0; i < n; i++) {
+		size_t off = chunk ? 0 : len;
+		int rc;
+
+		tlv_decoder_init(&dec, schema);
+		do {
+			off = off + chunk > len ? len : off + chunk;
+			rc = tlv_decode(&dec, buf, off, BENCH_BUF_SIZE);
+		} while (rc == 1);
+		sum += rc + dec.vals[1].u16;
+	}
+	return sum;
+}
+
+int main(int argc, char *argv[])
+{
+	TlvValue vals[TLV_FIELDS_MAX] = { { 0 } };
+	uint8_t get[BENCH_BUF_SIZE], res[BENCH_BUF_SIZE];
+	const char *text = "21'C, Mon Oct 19 03:49";
+	size_t get_len = 0, res_len = 0;
+	long n = 1000000, i;
+	unsigned sum;
+	int64_t t;
+	int c;
+
+	while ((c = getopt(argc, argv, "n:")) != -1) {
+		switch (c) {
+		case 'n':
+			n = atol(optarg);
+			break;
+		default:
+			usage();
+		}
+	}
+	if (optind < argc || n <= 0) {
+		usage();
+	}
+
+	vals[GET_TEXT].set = 1;
+	vals[GET_TEXT].str = text;
+	vals[GET_TEXT].len = strlen(text);
+	vals[GET_BRGHT].set = 1;
+	vals[GET_BRGHT].u16 = 60;
+
+	t = clock_nsec();
+	for (i = 0, sum = 0; i < n; i++) {
+		vals[GET_BRGHT].u16 = i;
+		get_len = tlv_encode(&proto_get_schema, get, sizeof(get), vals);
+		sum += get[get_len - 1];
+	}
+	report("encode GET", n, clock_nsec() - t, sum);
+
+	memset(vals, 0, sizeof(vals));
+	vals[RES_TEMP].set = vals[RES_BRGHT].set = 1;
+	t = clock_nsec();
+	for (i = 0, sum = 0; i < n; i++) {
+		vals[RES_TEMP].u16 = i;
+		vals[RES_BRGHT].u16 = i >> 8;
+		res_len = tlv_encode(&proto_res_schema, res, sizeof(res), vals);
+		sum += res[res_len - 1];
+	}
+	report("encode RES", n, clock_nsec() - t, sum);
+
+	t = clock_nsec();
+	sum = bench_decode(&proto_get_schema, get, get_len, n, 0);
+	report("decode GET", n, clock_nsec() - t, sum);
+
+	t = clock_nsec();
+	sum = bench_decode(&proto_res_schema, res, res_len, n, 0);
+	report("decode RES", n, clock_nsec() - t, sum);
+
+	/* Resumed decoding of messages received a few bytes at a time. */
+	t = clock_nsec();
+	sum = bench_decode(&proto_get_schema, get, get_len, n, 4);
+	report("decode GET/4", n, clock_nsec() - t, sum);
+
+	t = clock_nsec();
+	sum = bench_decode(&proto_res_schema, res, res_len, n, 4);
+	report("decode RES/4", n, clock_nsec() - t, sum);
+
+	return EXIT_SUCCESS;
+}
@@ -0,0 +1,205 @@
+#include <sys/mman.h>
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <err.h>
+
+#include "tlv.h"
+#include "proto.h"
+
+/*
+ * Fuzz the v1 decoder the way FUZZ_IO splits reads: tlvfuzz [-n iter]
+ * [-s seed]. Valid GET and RES messages are mutated and fed in chunks of
+ * random sizes, decoding stops at the first result which is not partial
+ * and must match a one-shot decoding of the same bytes. Bytes not received
+ * yet are garbage and the message ends at a guard page, so a read past the
+ * received bytes either changes the result or faults.
+ */
+#define FUZZ_SIZE		128
+
+static uint8_t *region;		/* FUZZ_SIZE bytes before the guard page */
+
+static void usage(void)
+{
+	fprintf(stderr, "usage: tlvfuzz [-n iterations] [-s seed]\n");
+	exit(EXIT_FAILURE);
+}
+
+static void dump(const char *what, const uint8_t *buf, size_t n,
+			size_t stop)
+{
+	size_t i;
+
+	fprintf(stderr, "%s at %zu of %zu bytes:", what, stop, n);
+	for (i = 0; i < n; i++) {
+		fprintf(stderr, " %02x", buf[i]);
+	}
+	fprintf(stderr, "\n");
+	exit(EXIT_FAILURE);
+}
+
+static size_t fuzz_message(const TlvSchema **schema, uint8_t *buf)
+{
+	TlvValue vals[TLV_FIELDS_MAX] = { { 0 } };
+	char text[FUZZ_SIZE];
+	size_t i, n;
+
+	if (rand() % 2) {
+		*schema = &proto_res_schema;
+		vals[RES_TEMP].set = vals[RES_BRGHT].set = 1;
+		vals[RES_TEMP].u16 = rand();
+		vals[RES_BRGHT].u16 = rand();
+	} else {
+		*schema = &proto_get_schema;
+		/* An empty GET or text with brightness. */
+		if (rand() % 4) {
+			n = rand() % (FUZZ_SIZE - 8);
+			for (i = 0; i < n; i++) {
+				text[i] = ' ' + rand() % 95;
+			}
+			vals[GET_TEXT].set = vals[GET_BRGHT].set = 1;
+			vals[GET_TEXT].str = text;
+			vals[GET_TEXT].len = n;
+			vals[GET_BRGHT].u16 = rand();
+		}
+	}
+
+	return tlv_encode(*schema, buf, FUZZ_SIZE, vals);
+}
+
+static size_t fuzz_mutate(uint8_t *buf, size_t n)
+{
+	int i, k = rand() % 4;
+
+	for (i = 0; i < k; i++) {
+		switch (rand() % 5) {
+		case 0:
+			buf[rand() % n] ^= 1 << rand() % 8;
+			break;
+		case 1:
+			buf[rand() % n] = rand();
+			break;
+		case 2:
+			/* The length field, it is at 1 and 2. */
+			buf[1 + rand() % 2] = rand();
+			break;
+		case 3:
+			n = 1 + rand() % n;
+			break;
+		default:
+			/* Trailing bytes of a next message. */
+			while (n < FUZZ_SIZE && rand() % 4) {
+				buf[n++] = rand();
+			}
+			break;
+		}
+	}
+	return n;
+}
+
+/* Place n received bytes before the guard page, the rest is garbage. */
+static const uint8_t *fuzz_place(const uint8_t *msg, size_t total, size_t n)
+{
+	uint8_t *buf = region + FUZZ_SIZE - total;
+
+	memcpy(buf, msg, n);
+	for (; n < total; n++) {
+		buf[n] = rand();
+	}
+	return buf;
+}
+
+static int fuzz_same(const TlvDecoder *a, const uint8_t *abuf,
+			const TlvDecoder *b, const uint8_t *bbuf, int nfields)
+{
+	int i;
+
+	for (i = 0; i < nfields; i++) {
+		const TlvValue *x = &a->vals[i], *y = &b->vals[i];
+
+		if (x->set != y->set || (x->set && (x->u16 != y->u16 ||
+		    x->len != y->len || (x->str == NULL) != (y->str == NULL) ||
+		    (x->str && x->str - (const char *)abuf !=
+				y->str - (const char *)bbuf)))) {
+			return 0;
+		}
+	}
+	return 1;
+}
+
+int main(int argc, char *argv[])
+{
+	unsigned long iters = 1000000, i, results[3] = { 0 };
+	unsigned seed = getpid();
+	uint8_t msg[FUZZ_SIZE];
+	long page = sysconf(_SC_PAGESIZE);
+	int c;
+
+	while ((c = getopt(argc, argv, "n:s:")) != -1) {
+		switch (c) {
+		case 'n':
+			iters = strtoul(optarg, NULL, 10);
+			break;
+		case 's':
+			seed = strtoul(optarg, NULL, 10);
+			break;
+		default:
+			usage();
+		}
+	}
+	if (optind < argc) {
+		usage();
+	}
+
+	uint8_t *map = mmap(NULL, 2 * page, PROT_READ | PROT_WRITE,
+				MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+	if (map == MAP_FAILED || mprotect(map + page, page, PROT_NONE) < 0) {
+		err(EXIT_FAILURE, "mmap()");
+	}
+	region = map + page - FUZZ_SIZE;
+	srand(seed);
+
+	for (i = 0; i < iters; i++) {
+		const TlvSchema *schema;
+		TlvDecoder dec, one;
+		const uint8_t *buf;
+		size_t total, n = 0;
+		int rc;
+
+		total = fuzz_mutate(msg, fuzz_message(&schema, msg));
+
+		/* Resumed decoding of chunks, the buffer is reused like the
+		 * peer buffer is, the received bytes stay in place. */
+		buf = fuzz_place(msg, total, 0);
+		tlv_decoder_init(&dec, schema);
+		do {
+			size_t m = 1 + rand() % (total - n);
+
+			memcpy((uint8_t *)buf + n, msg + n, m);
+			n += m;
+			rc = tlv_decode(&dec, buf, n, FUZZ_SIZE);
+		} while (rc == 1 && n < total);
+
+		/* The same received bytes at once. */
+		const uint8_t *obuf = fuzz_place(msg, total, n);
+		tlv_decoder_init(&one, schema);
+		int orc = tlv_decode(&one, obuf, n, FUZZ_SIZE);
+
+		if (rc != orc) {
+			fprintf(stderr, "resumed %d, one-shot %d\n", rc, orc);
+			dump("result mismatch", msg, total, n);
+		}
+		if (rc == 0 && !fuzz_same(&dec, buf, &one, obuf,
+						schema->nfields)) {
+			dump("value mismatch", msg, total, n);
+		}
+		results[rc + 1]++;
+	}
+
+	printf("seed %u: %lu messages, %lu complete, %lu partial, "
+		"%lu rejected\n", seed, iters, results[1], results[2],
+		results[0]);
+	return EXIT_SUCCESS;
+}
@@ -0,0 +1,152 @@
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <err.h>
+
+#include "utils.h"
+#include "unix.h"
+#include "tcp.h"
+#include "transport.h"
+
+static void unix_path(int addr, char *path, size_t n)
+{
+	snprintf(path, n, "%d", addr);
+}
+
+static int tr_unix_listen(int addr)
+{
+	char sock[32];
+	unix_path(addr, sock, sizeof(sock));
+
+	int rc = unlink(sock);
+	if (rc < 0 && errno != ENOENT) {
+		return -1;
+	}
+
+	return unix_listen(sock);
+}
+
+static void tr_unix_unlisten(int addr)
+{
+	char sock[32];
+	unix_path(addr, sock, sizeof(sock));
+	unlink(sock);
+}
+
+static int tr_unix_connect(int addr, int nonblock)
+{
+	char sock[32];
+	unix_path(addr, sock, sizeof(sock));
+	return unix_connect(sock, nonblock);
+}
+
+/* Endpoints of all addresses are resolved once at setup. */
+static struct sockaddr_in tcp_map[TRANSPORT_ADDR_MAX + 1];
+
+static int tr_tcp_listen(int addr)
+{
+	return tcp_listen(&tcp_map[addr]);
+}
+
+static void tr_tcp_unlisten(int addr)
+{
+	UNUSED(addr);
+}
+
+static int tr_tcp_connect(int addr, int nonblock)
+{
+	return tcp_connect(&tcp_map[addr], nonblock);
+}
+
+static const Transport transports[] = {
+	{
+		"unix",
+		tr_unix_listen,
+		tr_unix_unlisten,
+		unix_accept,
+		tr_unix_connect,
+		unix_check_connection,
+	}, {
+		"tcp",
+		tr_tcp_listen,
+		tr_tcp_unlisten,
+		tcp_accept,
+		tr_tcp_connect,
+		unix_check_connection,	/* SO_ERROR works for any socket */
+	},
+};
+
+const Transport *transport_find(const char *name)
+{
+	size_t i;
+
+	if (name == NULL) {
+		return &transports[0];
+	}
+
+	for (i = 0; i < ARRSZ(transports); i++) {
+		if (!strcmp(transports[i].name, name)) {
+			return &transports[i];
+		}
+	}
+
+	return NULL;
+}
+
+static int tcp_map_load(const char *map)
+{
+	char line[256], host[128];
+	int addr, port, n = 0;
+
+	FILE *fp = fopen(map, "r");
+	if (fp == NULL) {
+		warn("fopen(%s)", map);
+		return -1;
+	}
+
+	while (fgets(line, sizeof(line), fp) != NULL) {
+		n++;
+		if (*line == '#' || *line == '\n') {
+			continue;
+		}
+
+		struct sockaddr_in *sin = &tcp_map[0];
+		if (sscanf(line, "%d %127s %d", &addr, host, &port) != 3 ||
+		    addr < 0 || addr > TRANSPORT_ADDR_MAX ||
+		    port <= 0 || port > 65535 ||
+		    inet_pton(AF_INET, host, &sin[addr].sin_addr) != 1) {
+			warnx("%s:%d: expected \"addr host port\"", map, n);
+			fclose(fp);
+			return -1;
+		}
+		sin[addr].sin_port = htons(port);
+	}
+
+	fclose(fp);
+	return 0;
+}
+
+int transport_tcp_setup(const char *base, int port, const char *map)
+{
+	struct in_addr in;
+	int i;
+
+	if (inet_pton(AF_INET, base, &in) != 1 || port <= 0 || port > 65535) {
+		return -1;
+	}
+
+	for (i = 0; i <= TRANSPORT_ADDR_MAX; i++) {
+		memset(&tcp_map[i], 0, sizeof(tcp_map[i]));
+		tcp_map[i].sin_family = AF_INET;
+		tcp_map[i].sin_addr.s_addr = htonl(ntohl(in.s_addr) + i);
+		tcp_map[i].sin_port = htons(port);
+	}
+
+	return map ? tcp_map_load(map) : 0;
+}
@@ -0,0 +1,32 @@
+#ifndef TRANSPORT_H
+#define TRANSPORT_H
+
+/*
+ * A transport maps device addresses to stream endpoints. unix uses socket
+ * files named by the address in the working directory, tcp uses
+ * TCP_BASE + address (127.0.1.0 by default) and TCP_PORT, single addresses
+ * might be remapped to other hosts by TRANSPORT_MAP lines "addr host port".
+ */
+typedef struct Transport Transport;
+
+struct Transport {
+	const char	*name;
+	int		(*listen)(int addr);
+	void		(*unlisten)(int addr);
+	int		(*accept)(int fd, int nonblock);
+	int		(*connect)(int addr, int nonblock);
+	int		(*check_connection)(int fd);
+};
+
+/* Device addresses are [0, TRANSPORT_ADDR_MAX]. */
+#define TRANSPORT_ADDR_MAX	255
+#define TRANSPORT_TCP_BASE	"127.0.1.0"
+#define TRANSPORT_TCP_PORT	7000
+
+/* Find a transport by name, NULL returns the default one. */
+const Transport *transport_find(const char *name);
+
+/* Configure tcp endpoints, map might be NULL. */
+int transport_tcp_setup(const char *base, int port, const char *map);
+
+#endif
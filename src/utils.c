@@ -1,4 +1,5 @@
 #include <fcntl.h>
+#include <time.h>
 
 #include "utils.h"
 
@@ -10,3 +11,18 @@ int fd_nonblock(int fd)
 				? -1 : 0;
 }
 
+int64_t clock_msec(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (int64_t)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+int64_t clock_wall_msec(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_REALTIME, &ts);
+	return (int64_t)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
@@ -1,9 +1,19 @@
 #ifndef UTILS_H
 #define UTILS_H
 
+#include <stdint.h>
+
 #define ARRSZ(a)	(sizeof(a) / sizeof((a)[0]))
 #define UNUSED(x)       ((x) = (x))
+#define MIN(a, b)	((a) < (b) ? (a) : (b))
+#define MAX(a, b)	((a) > (b) ? (a) : (b))
 
 int fd_nonblock(int fd);
 
+/* Monotonic time in msec. */
+int64_t clock_msec(void);
+
+/* Wall clock time in msec, comparable across processes and restarts. */
+int64_t clock_wall_msec(void);
+
 #endif